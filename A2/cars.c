@@ -2,10 +2,326 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "traffic.h"
 
 extern struct intersection isection;
 
+struct car *car_arena;
+unsigned int ncars;
+struct car_times *car_times;
+
+// Times a thread checks a lane ring or the occupied quadrants again before
+// it goes to sleep: the other side usually moves within a few hundred
+// cycles. Spinning is pointless on a single cpu, where the other side can't
+// run meanwhile.
+#define SPINS 200
+static int spins;
+
+static void futex_wait(unsigned int *addr, unsigned int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/* Waits for a short while for *addr to change from val; returns its value. */
+static unsigned int spin_while(unsigned int *addr, unsigned int val) {
+    unsigned int cur = val;
+
+    for (int i = 0; i < spins && cur == val; i++) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+        cur = __atomic_load_n(addr, __ATOMIC_ACQUIRE);
+    }
+    return cur;
+}
+
+/* Wakes up to n threads sleeping on addr. */
+static void futex_wake(unsigned int *addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/*
+ * Admits a car whose path is mask into the intersection: waits until none
+ * of its quadrants is occupied, then takes them all with one
+ * compare-and-swap.
+ *
+ * Waiting works like in the lane rings below: a thread about to sleep
+ * counts itself in waiting and then checks the quadrants again; a car
+ * leaving frees its quadrants and then checks waiting.
+ */
+static void enter_quadrants(unsigned int mask) {
+    unsigned int occupied = __atomic_load_n(&isection.occupied, __ATOMIC_ACQUIRE);
+
+    while (1) {
+        if ((occupied & mask) == 0) {
+            // A failed exchange reloads occupied.
+            if (__atomic_compare_exchange_n(&isection.occupied, &occupied,
+                    occupied | mask, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                return;
+            }
+            continue;
+        }
+        occupied = spin_while(&isection.occupied, occupied);
+        if ((occupied & mask) == 0) {
+            continue;
+        }
+        __atomic_fetch_add(&isection.waiting, 1, __ATOMIC_SEQ_CST);
+        occupied = __atomic_load_n(&isection.occupied, __ATOMIC_SEQ_CST);
+        if (occupied & mask) {
+            futex_wait(&isection.occupied, occupied);
+        }
+        __atomic_fetch_sub(&isection.waiting, 1, __ATOMIC_RELAXED);
+        occupied = __atomic_load_n(&isection.occupied, __ATOMIC_ACQUIRE);
+    }
+}
+
+/* Frees the quadrants of a car that has crossed. */
+static void leave_quadrants(unsigned int mask) {
+    __atomic_fetch_and(&isection.occupied, ~mask, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&isection.waiting, __ATOMIC_SEQ_CST)) {
+        // The sleepers may be waiting for any of the quadrants.
+        futex_wake(&isection.occupied, INT_MAX);
+    }
+}
+
+/*
+ * Crossing policies: which of the cars waiting to enter the intersection
+ * goes first (traffic -p).
+ *  - free:   whichever takes its quadrants first (enter_quadrants)
+ *  - fifo:   the cars enter in the order they reached the intersection,
+ *            each taking a ticket
+ *  - oldest: a car may not pass an older waiting car it conflicts with,
+ *            older meaning queued in its lane earlier
+ *  - wrr:    weighted round-robin between the lanes, each weighted by the
+ *            cars still to pass through it: a car may not pass a waiting
+ *            car it conflicts with whose lane has more credit
+ */
+enum policy_kind crossing_policy = POLICY_FREE;
+const char *policy_names[MAX_POLICY] = { "free", "fifo", "oldest", "wrr" };
+
+struct policy {
+    void (*enter)(struct lane *l, struct car *car, unsigned int mask);
+    void (*leave)(unsigned int mask);
+};
+
+static void free_enter(struct lane *l, struct car *car, unsigned int mask) {
+    enter_quadrants(mask);
+}
+
+static unsigned int next_ticket, now_serving;
+static int ticket_waiting;
+
+static void fifo_enter(struct lane *l, struct car *car, unsigned int mask) {
+    unsigned int ticket = __atomic_fetch_add(&next_ticket, 1, __ATOMIC_RELAXED);
+    unsigned int serving = __atomic_load_n(&now_serving, __ATOMIC_ACQUIRE);
+
+    // Wait for our turn, like enter_quadrants waits for the quadrants.
+    while (serving != ticket) {
+        serving = spin_while(&now_serving, serving);
+        if (serving == ticket) {
+            break;
+        }
+        __atomic_fetch_add(&ticket_waiting, 1, __ATOMIC_SEQ_CST);
+        serving = __atomic_load_n(&now_serving, __ATOMIC_SEQ_CST);
+        if (serving != ticket) {
+            futex_wait(&now_serving, serving);
+        }
+        __atomic_fetch_sub(&ticket_waiting, 1, __ATOMIC_RELAXED);
+        serving = __atomic_load_n(&now_serving, __ATOMIC_ACQUIRE);
+    }
+
+    enter_quadrants(mask);
+    __atomic_store_n(&now_serving, ticket + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ticket_waiting, __ATOMIC_SEQ_CST)) {
+        futex_wake(&now_serving, INT_MAX);
+    }
+}
+
+/*
+ * The oldest and wrr policies: the waiting cars are listed under the
+ * arbiter's lock, and a car enters once its quadrants are free and no
+ * waiting car that goes before it needs any of them.
+ */
+struct waiter {
+    struct lane *lane;
+    unsigned int mask;
+    uint64_t since;             /* when the car was queued in its lane */
+    struct waiter *next;
+};
+
+static pthread_mutex_t arbiter_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t arbiter_cv = PTHREAD_COND_INITIALIZER;
+static struct waiter *waiters;
+
+static int older(struct waiter *a, struct waiter *b) {
+    return a->since < b->since || (a->since == b->since && a < b);
+}
+
+static int more_credit(struct waiter *a, struct waiter *b) {
+    if (a->lane->credit != b->lane->credit) {
+        return a->lane->credit > b->lane->credit;
+    }
+    return older(a, b);
+}
+
+static int may_enter(struct waiter *w) {
+    int (*before)(struct waiter *, struct waiter *) =
+        crossing_policy == POLICY_WRR ? more_credit : older;
+
+    if (isection.occupied & w->mask) {
+        return 0;
+    }
+    for (struct waiter *o = waiters; o != NULL; o = o->next) {
+        if (o != w && (o->mask & w->mask) && before(o, w)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Smooth weighted round-robin: every lane with a car waiting earns its
+ * weight in credit, and the lane whose car enters pays what they all
+ * earned.
+ */
+static void wrr_charge(struct lane *entered) {
+    int64_t total = 0;
+
+    for (int i = 0; i < MAX_DIRECTION * lanes_per_dir; i++) {
+        struct lane *l = isection.entry[i];
+        if (l->arbiter_waiting > 0) {
+            int64_t weight = 1 + __atomic_load_n(&l->inc, __ATOMIC_RELAXED);
+            l->credit += weight;
+            total += weight;
+        }
+    }
+    entered->credit -= total;
+}
+
+static void arbiter_enter(struct lane *l, struct car *car, unsigned int mask) {
+    struct waiter w = { l, mask, car_times ? CAR_TIMES(car).queued : 0, NULL };
+    struct waiter **p;
+
+    pthread_mutex_lock(&arbiter_lock);
+    w.next = waiters;
+    waiters = &w;
+    l->arbiter_waiting++;
+    while (!may_enter(&w)) {
+        pthread_cond_wait(&arbiter_cv, &arbiter_lock);
+    }
+    if (crossing_policy == POLICY_WRR) {
+        wrr_charge(l);
+    }
+    for (p = &waiters; *p != &w; p = &(*p)->next) {
+    }
+    *p = w.next;
+    l->arbiter_waiting--;
+    isection.occupied |= mask;
+    // Cars that had to let this one go first may go now.
+    pthread_cond_broadcast(&arbiter_cv);
+    pthread_mutex_unlock(&arbiter_lock);
+}
+
+static void arbiter_leave(unsigned int mask) {
+    pthread_mutex_lock(&arbiter_lock);
+    isection.occupied &= ~mask;
+    pthread_cond_broadcast(&arbiter_cv);
+    pthread_mutex_unlock(&arbiter_lock);
+}
+
+static struct policy policies[MAX_POLICY] = {
+    { free_enter, leave_quadrants },
+    { fifo_enter, leave_quadrants },
+    { arbiter_enter, arbiter_leave },
+    { arbiter_enter, arbiter_leave },
+};
+
+#ifdef LANE_SPSC
+/*
+ * Puts car into the lane's ring, sleeping while the ring is full. Only
+ * car_arrive calls this.
+ *
+ * A thread about to sleep sets its waiting flag and then checks the ring
+ * again; the other thread moves its counter and then checks the flag. Both
+ * sides use sequentially consistent accesses for this, so at least one of
+ * them sees the other's write and no wakeup is lost.
+ */
+static void lane_put(struct lane *l, struct car *car) {
+    unsigned int tail = l->tail;
+    unsigned int head = __atomic_load_n(&l->head, __ATOMIC_ACQUIRE);
+
+    if (tail - head == (unsigned int)l->capacity) {
+        head = spin_while(&l->head, head);
+    }
+    while (tail - head == (unsigned int)l->capacity) {
+        __atomic_store_n(&l->producer_waiting, 1, __ATOMIC_SEQ_CST);
+        head = __atomic_load_n(&l->head, __ATOMIC_SEQ_CST);
+        if (tail - head == (unsigned int)l->capacity) {
+            futex_wait(&l->head, head);
+        }
+        __atomic_store_n(&l->producer_waiting, 0, __ATOMIC_RELAXED);
+        head = __atomic_load_n(&l->head, __ATOMIC_ACQUIRE);
+    }
+
+    l->buffer[tail % l->capacity] = car;
+    __atomic_store_n(&l->tail, tail + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&l->consumer_waiting, __ATOMIC_SEQ_CST)) {
+        futex_wake(&l->tail, 1);
+    }
+}
+
+/*
+ * Takes up to max cars out of the lane's ring into cars, sleeping while the
+ * ring is empty; returns how many it took. Only car_cross calls this.
+ */
+static int lane_take(struct lane *l, struct car **cars, int max) {
+    unsigned int head = l->head;
+    unsigned int tail = __atomic_load_n(&l->tail, __ATOMIC_ACQUIRE);
+    int n;
+
+    if (tail == head) {
+        tail = spin_while(&l->tail, tail);
+    }
+    while (tail == head) {
+        __atomic_store_n(&l->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        tail = __atomic_load_n(&l->tail, __ATOMIC_SEQ_CST);
+        if (tail == head) {
+            futex_wait(&l->tail, tail);
+        }
+        __atomic_store_n(&l->consumer_waiting, 0, __ATOMIC_RELAXED);
+        tail = __atomic_load_n(&l->tail, __ATOMIC_ACQUIRE);
+    }
+
+    for (n = 0; n < max && head + n != tail; n++) {
+        cars[n] = l->buffer[(head + n) % l->capacity];
+    }
+    __atomic_store_n(&l->head, head + n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&l->producer_waiting, __ATOMIC_SEQ_CST)) {
+        futex_wake(&l->head, 1);
+    }
+    return n;
+}
+#endif
+
+/*
+ * Returns the index in isection.entry of the entry lane for a car from
+ * in_dir to out_dir: with dedicated lanes, the one for its movement.
+ */
+int entry_index(enum direction in_dir, enum direction out_dir) {
+    int k = 0;
+
+    if ((unsigned int)in_dir >= MAX_DIRECTION) {
+        compute_path(in_dir, out_dir);  // reports it and exits
+    }
+    if (lanes_per_dir > 1 && (unsigned int)out_dir < MAX_DIRECTION && out_dir != in_dir) {
+        // right turn 0, straight 1, left turn 2
+        k = (out_dir - in_dir + MAX_DIRECTION) % MAX_DIRECTION - 1;
+    }
+    return in_dir * lanes_per_dir + k;
+}
+
 /**
  * Populate the car lists by parsing a file where each line has
  * the following structure:
@@ -18,29 +334,77 @@ extern struct intersection isection;
  * Note: this also updates 'inc' on each of the lanes
  */
 void parse_schedule(char *file_name) {
-    int id;
+    struct sched_reader r;
     struct car *cur_car;
     struct lane *cur_lane;
-    enum direction in_dir, out_dir;
-    FILE *f = fopen(file_name, "r");
+    long v[3];
+    int n;
+
+    sched_open(&r, file_name);
+    car_arena = malloc(sizeof(struct car) * (sched_lines(&r) + 1));
 
     /* parse file */
-    while (fscanf(f, "%d %d %d", &id, (int*)&in_dir, (int*)&out_dir) == 3) {
+    while ((n = sched_line(&r, v, 3)) != -1) {
+        if (n < 3) {
+            break;
+        }
 
-        /* construct car */
-        cur_car = malloc(sizeof(struct car));
-        cur_car->id = id;
-        cur_car->in_dir = in_dir;
-        cur_car->out_dir = out_dir;
+        /* construct car; count it in its lane */
+        cur_car = &car_arena[ncars++];
+        cur_car->id = v[0];
+        cur_car->in_dir = v[1];
+        // An invalid out_dir is reported when the car crosses.
+        cur_car->out_dir = (unsigned long)v[2] < MAX_DIRECTION ? v[2] : UCHAR_MAX;
+        isection.entry[entry_index(v[1], v[2])]->inc++;
+    }
+    sched_close(&r);
+    if (bench || ordered_out || crossing_policy == POLICY_OLDEST) {
+        car_times = malloc(sizeof(struct car_times) * (ncars + 1));
+    }
 
-        /* append new car to head of corresponding list */
-        cur_lane = &isection.lanes[in_dir];
-        cur_car->next = cur_lane->in_cars;
-        cur_lane->in_cars = cur_car;
-        cur_lane->inc++;
+    /* list the cars of each lane, in order */
+    for (int i = 0; i < MAX_DIRECTION * lanes_per_dir; i++) {
+        cur_lane = isection.entry[i];
+        cur_lane->in_cars = malloc(sizeof(unsigned int) * (cur_lane->inc + 1));
     }
+    for (unsigned int i = 0; i < ncars; i++) {
+        cur_car = &car_arena[i];
+        cur_lane = isection.entry[entry_index(cur_car->in_dir, cur_car->out_dir)];
+        cur_lane->in_cars[cur_lane->in_count++] = i;
+    }
+}
 
-    fclose(f);
+static void init_lane(struct lane *l) {
+    // Initialize mutex and condition variable.
+    pthread_mutex_init(&l->lock, NULL);
+#ifndef LANE_SPSC
+    pthread_cond_init(&l->producer_cv, NULL);
+    pthread_cond_init(&l->consumer_cv, NULL);
+#endif
+    // Initialize buffer.
+    l->buffer = malloc(sizeof(struct car *) * lane_capacity);
+    // Initialize other parameter for the lane
+    l->in_cars = NULL;
+    l->in_count = 0;
+    l->out_cars = NULL;
+    l->head = 0;
+    l->tail = 0;
+    l->capacity = lane_capacity;
+#ifdef LANE_SPSC
+    l->consumer_waiting = 0;
+    l->producer_waiting = 0;
+#else
+    l->in_buf = 0;
+#endif
+    l->inc = 0;
+    l->passed = 0;
+    memset(l->quad_wait, 0, sizeof(l->quad_wait));
+    l->dequeues = 0;
+    l->admissions = 0;
+    memset(l->wait_hist, 0, sizeof(l->wait_hist));
+    l->max_wait = 0;
+    l->credit = 0;
+    l->arbiter_waiting = 0;
 }
 
 /**
@@ -51,29 +415,43 @@ void parse_schedule(char *file_name) {
  *
  */
 void init_intersection() {
-    // Initializes locks for quadrants
-    for (int i=0; i<4; i++){
-        pthread_mutex_init(&isection.quad[i], NULL);
+    spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPINS : 0;
+
+    // Precompute the quadrants of every movement as a bitmask, bit i for
+    // quadrant i + 1. U-turns are left 0.
+    isection.occupied = 0;
+    isection.waiting = 0;
+    for (int in = 0; in < MAX_DIRECTION; in++) {
+        for (int out = 0; out < MAX_DIRECTION; out++) {
+            isection.path_mask[in][out] = 0;
+            if (in == out) {
+                continue;
+            }
+            int *path = compute_path(in, out);
+            for (int i = 0; i < 4; i++) {
+                if (path[i] != 0) {
+                    isection.path_mask[in][out] |= 1u << i;
+                }
+            }
+            free(path);
+        }
     }
 
     // Initialize lanes, aka entrance to intersection. (fixed size buffer)
+    // Exits only use out_cars and passed of lanes[].
     for (int i = 0; i < 4; i++) {
-        // Initialize mutex and condition variable.
-        pthread_mutex_init(&isection.lanes[i].lock, NULL);
-		pthread_cond_init(&isection.lanes[i].producer_cv, NULL);
-		pthread_cond_init(&isection.lanes[i].consumer_cv, NULL);
-        // Initialize buffer.
-		isection.lanes[i].buffer = malloc(sizeof(struct car *) * LANE_LENGTH);
-        // Initialize other parameter for the lane
-		isection.lanes[i].in_cars = NULL;
-		isection.lanes[i].out_cars = NULL;
-		isection.lanes[i].head = 0;
-		isection.lanes[i].tail = 0;
-		isection.lanes[i].capacity = LANE_LENGTH;
-		isection.lanes[i].in_buf = 0;
-        isection.lanes[i].inc = 0;
-		isection.lanes[i].passed = 0;
-	}
+        init_lane(&isection.lanes[i]);
+    }
+    for (int d = 0; d < MAX_DIRECTION; d++) {
+        for (int k = 0; k < lanes_per_dir; k++) {
+            struct lane *l = &isection.lanes[d];
+            if (k > 0) {
+                l = malloc(sizeof(struct lane));
+                init_lane(l);
+            }
+            isection.entry[d * lanes_per_dir + k] = l;
+        }
+    }
 }
 
 /**
@@ -87,11 +465,22 @@ void init_intersection() {
 void *car_arrive(void *arg) {
     struct lane *l = arg;
 
+#ifdef LANE_SPSC
+    // The cars in_cars belong to this thread; only the ring is shared.
+    while (l->in_count > 0) {
+        struct car *car = &car_arena[l->in_cars[--l->in_count]];
+        if (bench || crossing_policy == POLICY_OLDEST) {
+            CAR_TIMES(car).queued = now_ns();
+        }
+        lane_put(l, car);
+    }
+#else
+
     while(1){
         pthread_mutex_lock(&l->lock);
 
         // Exit if no incoming cars.
-        if ((l->in_cars == NULL) || (l->inc <= 0)) {
+        if ((l->in_count == 0) || (l->inc <= 0)) {
             pthread_cond_signal(&l->consumer_cv);
             pthread_mutex_unlock(&l->lock);
             return NULL;
@@ -102,9 +491,12 @@ void *car_arrive(void *arg) {
             pthread_cond_wait(&l->consumer_cv, &l->lock);
         }
 
-        // Fetch the first waiting car from the list in_cars and add it to the entrance buffer.
-        l->buffer[l->tail] = l->in_cars;  // place the first incoming car into entering buffer
-        l->in_cars = l->in_cars->next;  // next incoming car becomes the first
+        // Fetch the next waiting car from in_cars and add it to the entrance buffer.
+        struct car *car = &car_arena[l->in_cars[--l->in_count]];
+        if (bench || crossing_policy == POLICY_OLDEST) {
+            CAR_TIMES(car).queued = now_ns();
+        }
+        l->buffer[l->tail] = car;  // place the incoming car into entering buffer
         l->tail++;
         if (l->tail >= l->capacity){ 
             l->tail=0;
@@ -114,6 +506,7 @@ void *car_arrive(void *arg) {
         pthread_cond_signal(&l->producer_cv);
         pthread_mutex_unlock(&l->lock);
     }
+#endif
 
     /* avoid compiler warning */
     l = l;
@@ -121,6 +514,236 @@ void *car_arrive(void *arg) {
     return NULL;
 }
 
+/* Returns the quadrants car passes through, 0 if it is not a valid movement. */
+static unsigned int car_path(struct car *car) {
+    if ((unsigned int)car->in_dir < MAX_DIRECTION &&
+        (unsigned int)car->out_dir < MAX_DIRECTION) {
+        return isection.path_mask[car->in_dir][car->out_dir];
+    }
+    return 0;
+}
+
+/*
+ * The cars a cross thread lets into the intersection, in order, kept in
+ * binary and printed EVENT_LOG_SIZE at a time: one stdio call per batch of
+ * lines instead of one per car, each of which takes the stdout lock.
+ */
+#define EVENT_LOG_SIZE 4096
+#define EVENT_LINE_MAX 36       /* three ints, two spaces and a newline */
+
+struct event {
+    uint64_t time;              /* when the car entered (ns) */
+    int id;
+    enum direction in_dir, out_dir;
+};
+
+struct event_log {
+    struct event *events;
+    int n;
+    char *text;                 /* EVENT_LOG_SIZE lines */
+};
+
+static void init_event_log(struct event_log *log) {
+    log->events = malloc(sizeof(struct event) * EVENT_LOG_SIZE);
+    log->text = malloc(EVENT_LOG_SIZE * EVENT_LINE_MAX);
+    log->n = 0;
+}
+
+/* Writes the decimal value of v at p; returns the end. */
+static char *format_int(char *p, int v) {
+    char digits[10];
+    unsigned int u = v;
+    int n = 0;
+
+    if (v < 0) {
+        *p++ = '-';
+        u = -u;
+    }
+    do {
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+    while (n > 0) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+/* Prints the logged cars in the format of the assignment and empties the log. */
+static void flush_events(struct event_log *log) {
+    char *p = log->text;
+
+    for (int i = 0; i < log->n; i++) {
+        p = format_int(p, log->events[i].in_dir);
+        *p++ = ' ';
+        p = format_int(p, log->events[i].out_dir);
+        *p++ = ' ';
+        p = format_int(p, log->events[i].id);
+        *p++ = '\n';
+    }
+    fwrite(log->text, 1, p - log->text, stdout);
+    log->n = 0;
+}
+
+static void log_event(struct event_log *log, struct car *car) {
+    struct event *e;
+
+    if (log->n == EVENT_LOG_SIZE) {
+        flush_events(log);
+    }
+    e = &log->events[log->n++];
+    e->time = now_ns();
+    e->id = car->id;
+    e->in_dir = car->in_dir;
+    e->out_dir = car->out_dir;
+}
+
+/*
+ * The cars a cross thread has passed into one exit lane, newest first. They
+ * are added to the exit lane's out_cars when the thread finishes, so
+ * crossing cars don't contend for the exit lanes' locks.
+ */
+struct out_log {
+    struct car *head, *tail;
+    int count;
+};
+
+/*
+ * Crosses the first of the n cars taken from lane l together with the cars
+ * right behind it making the same movement: the group takes its quadrants
+ * once. A car making another movement ends the group, so no car passes one
+ * ahead of it in its lane. The cars are added to the thread's log for their
+ * exit lane one at a time, in order, as if each had crossed on its own.
+ * Moves the remaining cars to the front of cars, in order, and returns how
+ * many there are.
+ */
+static int cross_group(struct lane *l, struct car **cars, int n, struct out_log *logs) {
+    struct car *first = cars[0];
+    unsigned int mask = car_path(first);
+    int count = 1, rest = 0;
+
+    if (mask == 0) {
+        // Not a valid movement: have compute_path report it and exit.
+        compute_path(first->in_dir, first->out_dir);
+    }
+
+    // The group is cars[0] to cars[count - 1].
+    while (count < n && cars[count]->out_dir == first->out_dir) {
+        count++;
+    }
+
+    // Wait to take all the quadrants involved at once.
+    if (bench) {
+        uint64_t start = now_ns();
+        policies[crossing_policy].enter(l, first, mask);
+        uint64_t now = now_ns();
+        for (int i = 0; i < 4; i++) {
+            if (mask & (1u << i)) {
+                __atomic_fetch_add(&l->quad_wait[i], now - start, __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_fetch_add(&l->admissions, 1, __ATOMIC_RELAXED);
+        // How long each car waited from being queued in its lane.
+        for (int i = 0; i < count; i++) {
+            uint64_t wait = now - CAR_TIMES(cars[i]).queued;
+            wait_hist_add(l->wait_hist, wait);
+            uint64_t max = __atomic_load_n(&l->max_wait, __ATOMIC_RELAXED);
+            while (wait > max && !__atomic_compare_exchange_n(&l->max_wait, &max, wait,
+                                                              1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+        }
+    } else {
+        policies[crossing_policy].enter(l, first, mask);
+    }
+
+    // Add the group to the log of the lane to which the cars leave, newest
+    // first like the rest of it.
+    struct out_log *log = &logs[first->out_dir];
+    uint64_t now = (bench || ordered_out) ? now_ns() : 0;
+    for (int i = 0; i < count; i++) {
+        struct car *car = cars[i];
+        if (bench || ordered_out) {
+            CAR_TIMES(car).exited = now;
+        }
+        car->next = log->head;
+        log->head = car;
+        if (log->tail == NULL) {
+            log->tail = car;
+        }
+    }
+    log->count += count;
+
+    // Free the region of passed cars.
+    policies[crossing_policy].leave(mask);
+
+    for (int i = count; i < n; i++) {
+        cars[rest++] = cars[i];
+    }
+    return rest;
+}
+
+/* Adds the cars in a cross thread's logs to the exit lanes' out_cars. */
+static void merge_logs(struct out_log *logs) {
+    for (int d = 0; d < MAX_DIRECTION; d++) {
+        struct lane *exit_lane = &isection.lanes[d];
+
+        if (logs[d].head == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&exit_lane->lock);
+        logs[d].tail->next = exit_lane->out_cars;
+        exit_lane->out_cars = logs[d].head;
+        exit_lane->passed += logs[d].count; //modify bookkeeping var
+        pthread_mutex_unlock(&exit_lane->lock);
+    }
+}
+
+struct out_pos {
+    struct car *car;
+    int pos;            /* position in out_cars before ordering */
+};
+
+static int cmp_exited(const void *a, const void *b) {
+    const struct out_pos *x = a, *y = b;
+
+    uint64_t tx = CAR_TIMES(x->car).exited, ty = CAR_TIMES(y->car).exited;
+
+    if (tx != ty) {
+        return tx < ty ? 1 : -1;   // newest first
+    }
+    return x->pos - y->pos;     // cars of one group stay newest first, as logged
+}
+
+/*
+ * Orders each exit lane's out_cars by the time the cars crossed, newest
+ * first, as if each car had been added to it as it crossed. Called once all
+ * cross threads have finished, with ordered_out set.
+ */
+void order_out_cars() {
+    for (int d = 0; d < MAX_DIRECTION; d++) {
+        struct lane *exit_lane = &isection.lanes[d];
+        struct out_pos *cars;
+        struct car *car;
+        int n = 0;
+
+        if (exit_lane->passed == 0) {
+            continue;
+        }
+        cars = malloc(sizeof(struct out_pos) * exit_lane->passed);
+        for (car = exit_lane->out_cars; car != NULL; car = car->next) {
+            cars[n].car = car;
+            cars[n].pos = n;
+            n++;
+        }
+        qsort(cars, n, sizeof(struct out_pos), cmp_exited);
+        for (int i = 0; i < n; i++) {
+            cars[i].car->next = (i + 1 < n) ? cars[i + 1].car : NULL;
+        }
+        exit_lane->out_cars = cars[0].car;
+        free(cars);
+    }
+}
+
 /**
  * TODO: Fill in this function
  *
@@ -145,71 +768,90 @@ void *car_arrive(void *arg) {
  */
 void *car_cross(void *arg) {
     struct lane *l = arg;
+    struct car **batch = malloc(sizeof(struct car *) * cross_batch);
+    struct out_log logs[MAX_DIRECTION];
+    struct event_log events;
+    int n;
+
+    memset(logs, 0, sizeof(logs));
+    if (!bench) {
+        init_event_log(&events);
+    }
   
     while(1){
+#ifdef LANE_SPSC
+        // Exit if all cars have passed. Only this thread changes inc: the
+        // ring has one cross thread per lane.
+        if (l->inc == 0) {
+            break;
+        }
+        n = lane_take(l, batch, cross_batch);
+        l->inc -= n;
+#else
         // First CS begins. Lock the lane.
         pthread_mutex_lock(&l->lock);
 
-        // Exit if all cars have passed.
-        if (l -> inc == 0){
-            pthread_mutex_unlock(&l->lock);
-            return NULL;
-        }
-
         // Wait if there are pending cars but buffer empty.
-        while (l->in_buf == 0){
+        while (l->in_buf == 0 && l->inc > 0){
             pthread_cond_wait(&l->producer_cv, &l->lock);
         }
 
+        // Exit if all cars have passed (or are being passed by other
+        // cross threads of this lane).
+        if (l -> inc == 0){
+            pthread_mutex_unlock(&l->lock);
+            break;
+        }
+
         // Now the lane buffer is non-empty, do the job.
-        // First, get the current crossing car from lane buffer.
-        struct car *current_car = l->buffer[l->head];
-        l->head++;
-        if (l->head >= l->capacity) { 
-            l->head = 0;
-        }
-        l->inc--;
-        l->in_buf--;
+        // First, get the crossing cars (up to a batch) from lane buffer.
+        for (n = 0; n < cross_batch && l->in_buf > 0; n++) {
+            batch[n] = l->buffer[l->head];
+            l->head++;
+            if (l->head >= l->capacity) { 
+                l->head = 0;
+            }
+            l->inc--;
+            l->in_buf--;
+        }
+        if (l->inc == 0) {
+            // Let the other cross threads of this lane exit.
+            pthread_cond_broadcast(&l->producer_cv);
+        }
 	
         // Signal producer for "buffer available".
         pthread_cond_signal(&l->consumer_cv);
         // Exit first CS, free the lock for lane.
         pthread_mutex_unlock(&l->lock);
-
-        printf("%d %d %d\n", current_car->in_dir, current_car->out_dir, current_car->id);
-
-
-        // Find the quadrants involved and lock them.
-        int* path = compute_path(current_car->in_dir,current_car->out_dir);
-        for (int i = 0; i < 4; i++){
-            if (path[i] != 0){
-                pthread_mutex_lock(&isection.quad[i]);
+#endif
+
+        if (bench) {
+            __atomic_fetch_add(&l->dequeues, 1, __ATOMIC_RELAXED);
+        } else {
+            for (int i = 0; i < n; i++) {
+                log_event(&events, batch[i]);
+                if (car_path(batch[i]) == 0) {
+                    // Print the cars so far, then have compute_path report
+                    // the invalid movement and exit.
+                    flush_events(&events);
+                    compute_path(batch[i]->in_dir, batch[i]->out_dir);
+                }
             }
         }
-        // Get the lane to which the car leaves.
-        struct lane* exit_lane = &isection.lanes[current_car->out_dir];
-
-        // Second CS begins. Lock the exiting lane.
-        pthread_mutex_lock(&exit_lane->lock);
-        // Add current car to .out_car in exiting lane.
-        current_car->next = exit_lane->out_cars;
-        exit_lane->out_cars = current_car;
-        exit_lane->passed++; //modify bookkeeping var
-        // End of second CS, finish with exiting lane.
-        pthread_mutex_unlock(&exit_lane->lock);
 
-        // Unlock the region of passed car.
-        for (int i = 0; i < 4; i++){
-            if (path[i] != 0){
-                pthread_mutex_unlock(&isection.quad[i]);
-            }
+        // Cross the batch a group at a time.
+        while (n > 0) {
+            n = cross_group(l, batch, n, logs);
         }
-        free(path);
     }
 
-    /* avoid compiler warning */
-    l = l;
-
+    if (!bench) {
+        flush_events(&events);
+        free(events.events);
+        free(events.text);
+    }
+    merge_logs(logs);
+    free(batch);
     return NULL;
 }
 
@@ -252,24 +894,29 @@ int *compute_path(enum direction in_dir, enum direction out_dir) {
                     path[1] = 2;
                     path[2] = 3;
                     path[3] = 4;
+                    break;
                 case SOUTH: // turn left
                     path[0] = 1;
                     path[1] = 2;
                     path[2] = 3;
                     path[3] = 0;
+                    break;
                 case WEST:  // go straight
                     path[0] = 1;
                     path[1] = 2;
                     path[2] = 0;
                     path[3] = 0;
+                    break;
                 case NORTH: // turn right
                     path[0] = 1;
                     path[1] = 0;
                     path[2] = 0;
                     path[3] = 0;
+                    break;
                 default:
                     break;
             }
+            break;
 
         case SOUTH:
             switch (out_dir) {
@@ -278,24 +925,29 @@ int *compute_path(enum direction in_dir, enum direction out_dir) {
                     path[1] = 0;
                     path[2] = 0;
                     path[3] = 1;
+                    break;
                 case SOUTH: // u-turn
                     path[0] = 2;
                     path[1] = 3;
                     path[2] = 4;
                     path[3] = 1;
+                    break;
                 case WEST:  // turn left
                     path[0] = 2;
                     path[1] = 3;
                     path[2] = 0;
                     path[3] = 1;
+                    break;
                 case NORTH: // go straight
                     path[0] = 2;
                     path[1] = 0;
                     path[2] = 0;
                     path[3] = 1;
+                    break;
                 default:
                     break;
             }
+            break;
 
         case WEST:
             switch (out_dir) {
@@ -304,24 +956,29 @@ int *compute_path(enum direction in_dir, enum direction out_dir) {
                     path[1] = 0;
                     path[2] = 1;
                     path[3] = 2;
+                    break;
                 case SOUTH: // turn right
                     path[0] = 0;
                     path[1] = 0;
                     path[2] = 1;
                     path[3] = 0;
+                    break;
                 case WEST:  // u-turn
                     path[0] = 3;
                     path[1] = 4;
                     path[2] = 1;
                     path[3] = 2;
+                    break;
                 case NORTH: // turn left
                     path[0] = 3;
                     path[1] = 0;
                     path[2] = 1;
                     path[3] = 2;
+                    break;
                 default:
                     break;
             }
+            break;
 
         case NORTH:
             switch (out_dir) {
@@ -330,24 +987,29 @@ int *compute_path(enum direction in_dir, enum direction out_dir) {
                     path[1] = 1;
                     path[2] = 2;
                     path[3] = 3;
+                    break;
                 case SOUTH: // go straight
                     path[0] = 0;
                     path[1] = 1;
                     path[2] = 2;
                     path[3] = 0;
+                    break;
                 case WEST:  // turn right
                     path[0] = 0;
                     path[1] = 1;
                     path[2] = 0;
                     path[3] = 0;
+                    break;
                 case NORTH: // u turn
                     path[0] = 4;
                     path[1] = 1;
                     path[2] = 2;
                     path[3] = 3;
+                    break;
                 default:
                     break;
             }
+            break;
         default:
             break;
     }
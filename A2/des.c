@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "traffic.h"
+
+extern struct intersection isection;
+
+/*
+ * Discrete-event simulation of the intersection (traffic -d), for schedules
+ * too large to push through the threads. Cars follow the same rules: each
+ * entry lane (see entry_index) sends its cars in order, one at a time, and
+ * a car enters once none of the quadrants on its path (isection.path_mask)
+ * is occupied, holding them until it has crossed. When several lanes could
+ * send a car, the crossing policy (-p, see cars.c) picks which goes first:
+ *  - free:   the car that arrived first, but any car whose quadrants are
+ *            free enters
+ *  - fifo:   the car that reached the front of its lane first, and no car
+ *            passes one that can't enter yet
+ *  - oldest: the car that arrived first, and no car passes an older one
+ *            that needs any of its quadrants
+ *  - wrr:    the car of the lane with the most credit, weighted by the
+ *            cars queued in it, and no car passes one it conflicts with
+ *
+ * Each line of the schedule may carry the car's arrival time and how long
+ * it takes to cross, in milliseconds:
+ *
+ * <id> <in_direction> <out_direction> [<arrival> [<duration>]]
+ *
+ * Cars without an arrival time arrive at 0; cars without a duration take
+ * des_quad_time per quadrant of their path.
+ *
+ * Arrivals are read in order of arrival time from the sorted schedule; the
+ * cars crossing are kept in a heap by the time they will have crossed.
+ */
+
+int des_quad_time = DES_QUAD_TIME;
+
+struct des_car {
+    uint64_t arrival;           /* ms */
+    uint32_t duration;          /* ms to cross */
+    uint32_t seq;               /* line in the schedule */
+    unsigned char in_dir, out_dir, lane;
+};
+
+struct des_lane {
+    uint32_t *queue;            /* cars waiting, a ring of size entries */
+    uint32_t head, count, size;
+    uint32_t max_count;
+    int crossing;               /* a car of this lane is crossing */
+    uint64_t ready;             /* when the first car could go (fifo) */
+    int64_t credit;             /* wrr */
+    uint64_t wait_hist[WAIT_BUCKETS];   /* ms from arrival to entering */
+    uint64_t max_wait;
+};
+
+/* a car that will have crossed at time */
+struct des_timer {
+    uint64_t time;
+    uint32_t seq;               /* order of timers due at the same time */
+    uint32_t car;
+};
+
+static struct des_car *cars;
+static uint32_t ndes_cars;
+static struct des_lane *lanes;
+static struct des_timer *heap;  /* at most one car per lane crosses */
+static int nheap;
+static unsigned int occupied;
+static uint32_t *delays;        /* ms each car waited to enter, in order of entering */
+static uint32_t nentered;
+static uint32_t timer_seq;
+
+static int cmp_arrival(const void *a, const void *b) {
+    const struct des_car *x = a, *y = b;
+
+    if (x->arrival != y->arrival) {
+        return x->arrival < y->arrival ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Reads the schedule into cars, sorted by arrival time. */
+static void des_parse(char *file_name) {
+    struct sched_reader r;
+    long v[5];
+    int n, sorted = 1;
+
+    sched_open(&r, file_name);
+    cars = malloc(sizeof(struct des_car) * (sched_lines(&r) + 1));
+    while ((n = sched_line(&r, v, 5)) != -1) {
+        int in_dir = v[1], out_dir = v[2];
+        uint64_t arrival = n > 3 ? v[3] : 0;
+        uint32_t duration = n > 4 ? v[4] : 0;
+        struct des_car *car;
+
+        if (n < 3) {
+            break;
+        }
+        if ((unsigned long)v[1] >= MAX_DIRECTION || (unsigned long)v[2] >= MAX_DIRECTION ||
+            isection.path_mask[in_dir][out_dir] == 0) {
+            compute_path(v[1], v[2]);   // reports it and exits
+        }
+        car = &cars[ndes_cars];
+        car->arrival = arrival;
+        car->duration = duration ? duration :
+            des_quad_time * __builtin_popcount(isection.path_mask[in_dir][out_dir]);
+        car->seq = ndes_cars;
+        car->in_dir = in_dir;
+        car->out_dir = out_dir;
+        car->lane = entry_index(in_dir, out_dir);
+        if (ndes_cars > 0 && arrival < cars[ndes_cars - 1].arrival) {
+            sorted = 0;
+        }
+        ndes_cars++;
+    }
+    sched_close(&r);
+
+    if (!sorted) {
+        qsort(cars, ndes_cars, sizeof(struct des_car), cmp_arrival);
+    }
+}
+
+static int timer_before(struct des_timer *a, struct des_timer *b) {
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void heap_push(uint64_t time, uint32_t car) {
+    int i = nheap++;
+
+    heap[i].time = time;
+    heap[i].seq = timer_seq++;
+    heap[i].car = car;
+    while (i > 0 && timer_before(&heap[i], &heap[(i - 1) / 2])) {
+        struct des_timer t = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = t;
+        i = (i - 1) / 2;
+    }
+}
+
+static struct des_timer heap_pop() {
+    struct des_timer top = heap[0];
+    int i = 0;
+
+    heap[0] = heap[--nheap];
+    while (1) {
+        int min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < nheap && timer_before(&heap[l], &heap[min])) {
+            min = l;
+        }
+        if (r < nheap && timer_before(&heap[r], &heap[min])) {
+            min = r;
+        }
+        if (min == i) {
+            break;
+        }
+        struct des_timer t = heap[i];
+        heap[i] = heap[min];
+        heap[min] = t;
+        i = min;
+    }
+    return top;
+}
+
+static void lane_push(struct des_lane *l, uint32_t car) {
+    if (l->count == l->size) {
+        uint32_t *queue = malloc(sizeof(uint32_t) * l->size * 2);
+        for (uint32_t i = 0; i < l->count; i++) {
+            queue[i] = l->queue[(l->head + i) % l->size];
+        }
+        free(l->queue);
+        l->queue = queue;
+        l->head = 0;
+        l->size *= 2;
+    }
+    l->queue[(l->head + l->count) % l->size] = car;
+    l->count++;
+    if (l->count > l->max_count) {
+        l->max_count = l->count;
+    }
+}
+
+static struct des_car *head_car(struct des_lane *l) {
+    return &cars[l->queue[l->head]];
+}
+
+/* Returns whether lane a's first car goes before lane b's. */
+static int goes_before(struct des_lane *a, struct des_lane *b) {
+    if (crossing_policy == POLICY_FIFO && a->ready != b->ready) {
+        return a->ready < b->ready;
+    }
+    if (crossing_policy == POLICY_WRR && a->credit != b->credit) {
+        return a->credit > b->credit;
+    }
+    return cmp_arrival(head_car(a), head_car(b)) < 0;
+}
+
+/*
+ * Lets in, at time now, the first car of every lane that is not already
+ * sending one and may go under the crossing policy.
+ */
+static void des_admit(uint64_t now, int nlanes) {
+    int waiting[MAX_DIRECTION * MAX_LANES_PER_DIR], n = 0;
+    unsigned int reserved = 0;  /* quadrants of cars that go first */
+    int64_t total = 0;
+
+    // Lanes with a car waiting, in the order the policy lets them go.
+    for (int i = 0; i < nlanes; i++) {
+        struct des_lane *l = &lanes[i];
+        if (l->count == 0 || l->crossing) {
+            continue;
+        }
+        int j = n++;
+        while (j > 0 && goes_before(l, &lanes[waiting[j - 1]])) {
+            waiting[j] = waiting[j - 1];
+            j--;
+        }
+        waiting[j] = i;
+        total += 1 + l->count;
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct des_lane *l = &lanes[waiting[i]];
+        uint32_t c = l->queue[l->head];
+        unsigned int mask = isection.path_mask[cars[c].in_dir][cars[c].out_dir];
+        uint64_t wait = now - cars[c].arrival;
+
+        if ((occupied | reserved) & mask) {
+            if (crossing_policy == POLICY_FIFO) {
+                break;
+            }
+            if (crossing_policy != POLICY_FREE) {
+                reserved |= mask;
+            }
+            continue;
+        }
+        if (crossing_policy == POLICY_WRR) {
+            // Smooth weighted round-robin, as in cars.c.
+            for (int j = 0; j < n; j++) {
+                lanes[waiting[j]].credit += 1 + lanes[waiting[j]].count;
+            }
+            l->credit -= total;
+        }
+        occupied |= mask;
+        l->head = (l->head + 1) % l->size;
+        l->count--;
+        l->crossing = 1;
+        delays[nentered++] = wait > UINT32_MAX ? UINT32_MAX : wait;
+        wait_hist_add(l->wait_hist, wait);
+        if (wait > l->max_wait) {
+            l->max_wait = wait;
+        }
+        heap_push(now + cars[c].duration, c);
+    }
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Simulates the schedule in file_name and prints the throughput and how
+ * long cars waited to enter the intersection.
+ */
+void des_run(char *file_name) {
+    int nlanes = MAX_DIRECTION * lanes_per_dir;
+    uint64_t now = 0, first = 0, total_delay = 0;
+    uint32_t next = 0;
+    uint64_t start = now_ns();
+
+    des_parse(file_name);
+    lanes = calloc(nlanes, sizeof(struct des_lane));
+    for (int i = 0; i < nlanes; i++) {
+        lanes[i].size = 64;
+        lanes[i].queue = malloc(sizeof(uint32_t) * lanes[i].size);
+    }
+    heap = malloc(sizeof(struct des_timer) * nlanes);
+    delays = malloc(sizeof(uint32_t) * (ndes_cars ? ndes_cars : 1));
+    if (ndes_cars > 0) {
+        first = cars[0].arrival;
+    }
+
+    while (next < ndes_cars || nheap > 0) {
+        // Next event: cars having crossed go before arrivals at the same time.
+        now = (nheap > 0 && (next == ndes_cars || heap[0].time <= cars[next].arrival)) ?
+            heap[0].time : cars[next].arrival;
+        while (nheap > 0 && heap[0].time == now) {
+            struct des_timer t = heap_pop();
+            struct des_car *car = &cars[t.car];
+            occupied &= ~isection.path_mask[car->in_dir][car->out_dir];
+            lanes[car->lane].crossing = 0;
+            lanes[car->lane].ready = now;
+            isection.lanes[car->out_dir].passed++;
+        }
+        while (next < ndes_cars && cars[next].arrival == now) {
+            struct des_lane *l = &lanes[cars[next].lane];
+            if (l->count == 0 && !l->crossing) {
+                l->ready = now;
+            }
+            lane_push(l, next);
+            next++;
+        }
+        des_admit(now, nlanes);
+    }
+
+    for (uint32_t i = 0; i < nentered; i++) {
+        total_delay += delays[i];
+    }
+    qsort(delays, nentered, sizeof(uint32_t), cmp_u32);
+
+    printf("Cars: %u in %.3f s simulated, %.1f cars/s\n", ndes_cars,
+           (now - first) / 1e3, now > first ? ndes_cars / ((now - first) / 1e3) : 0.0);
+    if (nentered > 0) {
+        printf("Delay (arrival to entering): mean %.1f ms, p50 %u ms, p99 %u ms, "
+               "max %u ms\n", (double)total_delay / nentered,
+               delays[(uint32_t)(nentered * 0.5)], delays[(uint32_t)(nentered * 0.99)],
+               delays[nentered - 1]);
+    }
+    printf("Waits to enter (%s policy):\n", policy_names[crossing_policy]);
+    for (int i = 0; i < nlanes; i++) {
+        char name[64];
+        if (lanes_per_dir > 1) {
+            sprintf(name, "Lane %d.%d", i / lanes_per_dir, i % lanes_per_dir);
+        } else {
+            sprintf(name, "Lane %d", i);
+        }
+        sprintf(name + strlen(name), " (longest queue %u)", lanes[i].max_count);
+        print_wait_hist(name, lanes[i].wait_hist, lanes[i].max_wait, 1, "ms");
+    }
+    for (int d = 0; d < MAX_DIRECTION; d++) {
+        printf("Exit %d: %d cars\n", d, isection.lanes[d].passed);
+    }
+    printf("Simulated in %.3f s\n", (now_ns() - start) / 1e9);
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "traffic.h"
+
+/*
+ * Schedule reader: maps the whole file and parses the integers on each line
+ * in place, without the stdio buffering and format parsing of fscanf. The
+ * kernel is told the file is read in order, so it reads ahead.
+ */
+
+void sched_open(struct sched_reader *r, char *file_name) {
+    struct stat st;
+    int fd = open(file_name, O_RDONLY);
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(file_name);
+        exit(1);
+    }
+    r->size = st.st_size;
+    r->data = NULL;
+    if (r->size > 0) {
+        r->data = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (r->data == MAP_FAILED) {
+            perror(file_name);
+            exit(1);
+        }
+        madvise(r->data, r->size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    r->p = r->data;
+    r->end = r->data + r->size;
+}
+
+void sched_close(struct sched_reader *r) {
+    if (r->data != NULL) {
+        munmap(r->data, r->size);
+    }
+}
+
+/* Returns the number of lines left, counting a last line without a newline. */
+size_t sched_lines(struct sched_reader *r) {
+    size_t n = 0;
+    char *p = r->p, *nl;
+
+    while (p < r->end && (nl = memchr(p, '\n', r->end - p)) != NULL) {
+        n++;
+        p = nl + 1;
+    }
+    return n + (p < r->end);
+}
+
+/*
+ * Parses up to max integers from the start of the next line that isn't
+ * blank into v and moves on to the line after it. Returns how many it
+ * parsed, stopping at anything that isn't one, or -1 at the end of the
+ * file.
+ */
+int sched_line(struct sched_reader *r, long *v, int max) {
+    char *p = r->p;
+    int n = 0;
+
+    while (p < r->end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        p++;
+    }
+    if (p >= r->end) {
+        return -1;
+    }
+    while (n < max) {
+        int neg = 0;
+        long x = 0;
+
+        while (p < r->end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+            p++;
+        }
+        if (p < r->end && *p == '-') {
+            neg = 1;
+            p++;
+        }
+        if (p >= r->end || *p < '0' || *p > '9') {
+            break;
+        }
+        while (p < r->end && *p >= '0' && *p <= '9') {
+            x = x * 10 + (*p++ - '0');
+        }
+        v[n++] = neg ? -x : x;
+    }
+
+    p = memchr(p, '\n', r->end - p);
+    r->p = p ? p + 1 : r->end;
+    return n;
+}
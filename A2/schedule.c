@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "traffic.h"
+
+/*
+ * Generates schedules for traffic, one car per line:
+ *
+ * <id> <in_direction> <out_direction>
+ *
+ * in one of these mixes:
+ *  - uniform:  in and out directions uniformly at random (no U-turns)
+ *  - rush:     rush hour, most cars come in from the north and go straight
+ *              on, the rest are uniform
+ *  - conflict: every car turns left, through three quadrants, so almost
+ *              every pair of cars conflicts
+ *
+ * Given a rate in cars per second, each line also carries the car's arrival
+ * time in milliseconds (see des.c), the cars arriving at random at that
+ * average rate.
+ */
+
+// Share of the cars in the rush hour stream, in percent.
+#define RUSH_SHARE 80
+
+/* Movements from in_dir, see compute_path. */
+static enum direction straight(enum direction in_dir) {
+    return (in_dir + 2) % MAX_DIRECTION;
+}
+
+static enum direction left(enum direction in_dir) {
+    return (in_dir + 3) % MAX_DIRECTION;
+}
+
+static enum direction random_out(enum direction in_dir) {
+    return (in_dir + 1 + rand() % (MAX_DIRECTION - 1)) % MAX_DIRECTION;
+}
+
+int main(int argc, char *argv[]) {
+    int cars, id;
+    enum direction in_dir, out_dir;
+    double rate = 0, arrival = 0;
+
+    if (argc == 5) {
+        rate = atof(argv[4]);
+    }
+    if (argc < 3 || argc > 5 || (cars = atoi(argv[2])) <= 0 || (argc == 5 && rate <= 0) ||
+        (strcmp(argv[1], "uniform") != 0 && strcmp(argv[1], "rush") != 0 &&
+         strcmp(argv[1], "conflict") != 0)) {
+        printf("Usage: %s uniform|rush|conflict <cars> [seed [cars_per_second]]\n", argv[0]);
+        exit(1);
+    }
+    srand(argc >= 4 ? atoi(argv[3]) : 1);
+
+    for (id = 0; id < cars; id++) {
+        in_dir = rand() % MAX_DIRECTION;
+        if (strcmp(argv[1], "conflict") == 0) {
+            out_dir = left(in_dir);
+        } else if (strcmp(argv[1], "rush") == 0 && rand() % 100 < RUSH_SHARE) {
+            in_dir = NORTH;
+            out_dir = straight(in_dir);
+        } else {
+            out_dir = random_out(in_dir);
+        }
+        if (rate > 0) {
+            // exponentially distributed gaps between arrivals
+            arrival += -log((rand() + 1.0) / (RAND_MAX + 2.0)) / rate * 1000;
+            printf("%d %d %d %.0f\n", id, in_dir, out_dir, arrival);
+        } else {
+            printf("%d %d %d\n", id, in_dir, out_dir);
+        }
+    }
+
+    return 0;
+}
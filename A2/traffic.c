@@ -1,9 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "traffic.h"
 
 struct intersection isection;
+int bench = 0;
+int lane_capacity = LANE_LENGTH;
+int lanes_per_dir = 1;
+int cross_workers = 1;
+int cross_batch = CROSS_BATCH;
+int ordered_out = 0;
 
 /*
  *
@@ -29,39 +36,236 @@ void verify() {
 	printf("===\n");
 }
 
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Returns the p-th percentile of the n sorted values in v. */
+static uint64_t percentile(uint64_t *v, int n, double p) {
+    int i = (int)(p / 100 * n);
+    return v[i < n ? i : n - 1];
+}
+
+/*
+ * Counts wait in hist, whose bucket b counts waits below 2^b (and at least
+ * 2^(b-1)); the last bucket also counts longer waits.
+ */
+void wait_hist_add(uint64_t *hist, uint64_t wait) {
+    int b = wait ? 64 - __builtin_clzll(wait) : 0;
+
+    __atomic_fetch_add(&hist[b < WAIT_BUCKETS ? b : WAIT_BUCKETS - 1], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Prints a wait histogram with the longest wait, p99 and the counts of
+ * the buckets in use, the waits converted to unit by multiplying by scale.
+ */
+void print_wait_hist(char *name, uint64_t *hist, uint64_t max, double scale, char *unit) {
+    uint64_t total = 0, seen = 0;
+    int b, p99 = 0;
+
+    for (b = 0; b < WAIT_BUCKETS; b++) {
+        total += hist[b];
+    }
+    for (b = 0; b < WAIT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen * 100 >= total * 99) {
+            p99 = b;
+            break;
+        }
+    }
+    printf("%s: %llu cars, max wait %g %s, p99 < %g %s\n", name, (unsigned long long)total,
+           max * scale, unit, (double)(1ull << p99) * scale, unit);
+    if (total == 0) {
+        return;
+    }
+    printf("  ");
+    for (b = 0; b < WAIT_BUCKETS; b++) {
+        if (hist[b] != 0) {
+            printf(" <%.3g:%llu", (double)(1ull << b) * scale, (unsigned long long)hist[b]);
+        }
+    }
+    printf(" (%s)\n", unit);
+}
+
+/*
+ * Prints what a bench run measured: the throughput, the distribution of
+ * the time from a car being queued in its lane to leaving the
+ * intersection, and how long cars waited for each quadrant.
+ */
+void bench_report(uint64_t elapsed) {
+    int i, n = 0, cars = 0, nlanes = MAX_DIRECTION * lanes_per_dir;
+    uint64_t *latency, dequeues = 0, admissions = 0;
+    struct car *cur;
+
+    for (i = 0; i < 4; i++) {
+        cars += isection.lanes[i].passed;
+    }
+    latency = malloc(sizeof(uint64_t) * (cars ? cars : 1));
+    for (i = 0; i < 4; i++) {
+        for (cur = isection.lanes[i].out_cars; cur != NULL; cur = cur->next) {
+            latency[n++] = CAR_TIMES(cur).exited - CAR_TIMES(cur).queued;
+        }
+    }
+    qsort(latency, n, sizeof(uint64_t), cmp_u64);
+
+    printf("Cars: %d in %.3f s, %.0f cars/s\n", n, elapsed / 1e9,
+           elapsed ? n / (elapsed / 1e9) : 0.0);
+    if (n > 0) {
+        printf("Latency (queued to exit): p50 %.1f us, p99 %.1f us, max %.1f us\n",
+               percentile(latency, n, 50) / 1e3, percentile(latency, n, 99) / 1e3,
+               latency[n - 1] / 1e3);
+    }
+    for (i = 0; i < nlanes; i++) {
+        dequeues += isection.entry[i]->dequeues;
+        admissions += isection.entry[i]->admissions;
+    }
+    if (n > 0) {
+        printf("Lane lock round trips: %.3f per car; admissions: %.3f per car\n",
+               (double)dequeues / n, (double)admissions / n);
+    }
+    for (int q = 0; q < 4; q++) {
+        uint64_t wait = 0;
+        for (i = 0; i < nlanes; i++) {
+            wait += isection.entry[i]->quad_wait[q];
+        }
+        printf("Quadrant %d: %.3f ms waiting\n", q + 1, wait / 1e6);
+    }
+    printf("Waits to enter (%s policy):\n", policy_names[crossing_policy]);
+    for (i = 0; i < nlanes; i++) {
+        char name[32];
+        if (lanes_per_dir > 1) {
+            sprintf(name, "Lane %d.%d", i / lanes_per_dir, i % lanes_per_dir);
+        } else {
+            sprintf(name, "Lane %d", i);
+        }
+        print_wait_hist(name, isection.entry[i]->wait_hist, isection.entry[i]->max_wait,
+                        1e-3, "us");
+    }
+    free(latency);
+}
+
+static void usage(char *prog) {
+    printf("Usage: %s [-b] [-c capacity] [-k batch] [-l 1|3] [-o] [-p policy] "
+           "[-w threads] <schedules_file>\n", prog);
+    printf("       %s -d [-l 1|3] [-p policy] [-t ms] <schedules_file>\n", prog);
+    printf("  -b  bench: report throughput, latency and quadrant waits "
+           "instead of the cars\n");
+    printf("  -d  discrete-event simulation: report throughput and delays in "
+           "simulated time\n");
+    printf("  -c  cars each entry lane holds (default %d)\n", LANE_LENGTH);
+    printf("  -k  cars a cross thread takes out of its lane at once "
+           "(default %d)\n", CROSS_BATCH);
+    printf("  -l  entry lanes per direction: 1 shared, or 3 for right turns, "
+           "straight and left turns (default 1)\n");
+    printf("  -o  list the cars leaving each lane in the order they crossed\n");
+    printf("  -p  which waiting car enters first: free (default), fifo, oldest "
+           "or wrr (see cars.c)\n");
+    printf("  -t  ms a car takes to cross a quadrant, unless the schedule "
+           "says (default %d)\n", DES_QUAD_TIME);
+    printf("  -w  cross threads per entry lane (default 1)\n");
+    exit(1);
+}
+
 int main(int argc, char *argv[]) {
-    int i;
-    pthread_t in_threads[4], cross_threads[4];
+    int i, opt, nlanes, des = 0;
+    pthread_t *in_threads, *cross_threads;
+    uint64_t start;
 
-    if (argc != 2) {
-        printf("Usage: %s <schedules_file>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "bc:dk:l:op:t:w:")) != -1) {
+        switch (opt) {
+            case 'b':
+                bench = 1;
+                break;
+            case 'c':
+                lane_capacity = atoi(optarg);
+                break;
+            case 'd':
+                des = 1;
+                break;
+            case 'k':
+                cross_batch = atoi(optarg);
+                break;
+            case 'l':
+                lanes_per_dir = atoi(optarg);
+                break;
+            case 'o':
+                ordered_out = 1;
+                break;
+            case 'p':
+                for (crossing_policy = 0; crossing_policy < MAX_POLICY; crossing_policy++) {
+                    if (strcmp(optarg, policy_names[crossing_policy]) == 0) {
+                        break;
+                    }
+                }
+                if (crossing_policy == MAX_POLICY) {
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                des_quad_time = atoi(optarg);
+                break;
+            case 'w':
+                cross_workers = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 || lane_capacity < 1 || cross_workers < 1 || cross_batch < 1 || des_quad_time < 0 ||
+        (lanes_per_dir != 1 && lanes_per_dir != MAX_LANES_PER_DIR)) {
+        usage(argv[0]);
+    }
+#ifdef LANE_SPSC
+    if (cross_workers != 1) {
+        fprintf(stderr, "The lock-free lanes have one cross thread each.\n");
         exit(1);
     }
+#endif
 
     init_intersection();
-    parse_schedule(argv[1]);
+    if (des) {
+        des_run(argv[optind]);
+        return 0;
+    }
+    parse_schedule(argv[optind]);
+    nlanes = MAX_DIRECTION * lanes_per_dir;
+    in_threads = malloc(sizeof(pthread_t) * nlanes);
+    cross_threads = malloc(sizeof(pthread_t) * nlanes * cross_workers);
+    start = now_ns();
 
     /* spin up threads */
-    for (i = 0; i < 4; i++) {
-        pthread_create(&cross_threads[i], NULL, &car_cross, (void *) &isection.lanes[i]);
-        pthread_create(&in_threads[i], NULL, &car_arrive, (void *) &isection.lanes[i]);
+    for (i = 0; i < nlanes; i++) {
+        for (int w = 0; w < cross_workers; w++) {
+            pthread_create(&cross_threads[i * cross_workers + w], NULL, &car_cross,
+                           (void *) isection.entry[i]);
+        }
+        pthread_create(&in_threads[i], NULL, &car_arrive, (void *) isection.entry[i]);
     }
 
     /* wait for all arrival threads */
-    for (i = 0; i < 4; i++) {
+    for (i = 0; i < nlanes * cross_workers; i++) {
         if (pthread_join(cross_threads[i], NULL)) {
             exit(1);
         }
     }
 
     /* wait for all crossing threads */
-    for (i = 0; i < 4; i++) {
+    for (i = 0; i < nlanes; i++) {
         if (pthread_join(in_threads[i], NULL)) {
             exit(1);
         }
     }
 
-	verify();
+    if (ordered_out) {
+        order_out_cars();
+    }
+    if (bench) {
+        bench_report(now_ns() - start);
+    } else {
+        verify();
+    }
 
     return 0;
 }
@@ -2,8 +2,22 @@
 #define __TRAFFIC_H__
 
 #include <pthread.h>
-
-#define LANE_LENGTH 10
+#include <stdint.h>
+#include <time.h>
+
+#define LANE_LENGTH 10   /* default lane capacity */
+#define MAX_LANES_PER_DIR 3
+#define CROSS_BATCH 8    /* default cars a cross thread takes at once */
+#define DES_QUAD_TIME 1000  /* default ms to cross a quadrant, see des.c */
+#define WAIT_BUCKETS 48
+
+/*
+ * The lane buffer is handed from car_arrive to car_cross either under the
+ * lane's mutex with two condition variables (default) or, if built with
+ * LANE_SPSC defined (make SPSC=1), through a lock-free single-producer
+ * single-consumer ring that only sleeps on a futex when it is empty or full.
+ */
+#define CACHE_LINE 64
 
 /* directions */
 enum direction {
@@ -19,26 +33,48 @@ struct car {
     /* id that uniquely identifies each car */
     int             id;
 
-    /* direction from which the car is entering and leaving */
-    enum direction  in_dir, out_dir;
+    /* direction from which the car is entering and leaving (enum direction,
+       kept in a byte each) */
+    unsigned char   in_dir, out_dir;
 
     /* support for singly linked list */
     struct car      *next;
 };
 
+/*
+ * when each car of car_arena was queued in its lane (bench mode) and left
+ * (bench mode or ordered_out) (ns), kept apart from the cars so struct car
+ * stays small; NULL when not needed
+ */
+struct car_times {
+    uint64_t        queued, exited;
+};
+
+extern struct car_times *car_times;
+#define CAR_TIMES(car) (car_times[(car) - car_arena])
+
 /* entry lane feeding into the intersection */
 struct lane {
     /* synchronization */
     pthread_mutex_t lock;
+#ifndef LANE_SPSC
     pthread_cond_t  producer_cv, consumer_cv;
+#endif
 
-    /* list of cars that are pending to pass through this lane */
-    struct car      *in_cars;
+    /*
+     * cars that are pending to pass through this lane, as indices into
+     * car_arena; the next one to arrive is the last, in_cars[in_count - 1]
+     */
+    unsigned int    *in_cars;
+    int             in_count;
 
     /*
      * list of cars that have passed the intersection into this lane.
      * This list should only be appended to and left in memory for us
      * to use during testing. Please do not free the list or any of the cars
+     *
+     * Each cross thread collects the cars it passes and adds them here
+     * when it finishes.
      */
     struct car      *out_cars;
 
@@ -51,17 +87,50 @@ struct lane {
     /* circular buffer implementation */
     struct car      **buffer;
 
+    /* maximum number of elements in the list */
+    int             capacity;
+
+    /*
+     * bench mode: time the cross threads waited to be admitted into the
+     * intersection, charged to each quadrant of the car's path (ns)
+     */
+    uint64_t        quad_wait[4];
+
+    /* bench mode: batches taken out of the lane and groups admitted */
+    uint64_t        dequeues, admissions;
+
+    /*
+     * bench mode: how long the cars waited from being queued in the lane
+     * to entering the intersection, by power of two (see wait_hist_add),
+     * and the longest wait (ns)
+     */
+    uint64_t        wait_hist[WAIT_BUCKETS];
+    uint64_t        max_wait;
+
+    /* wrr policy: the lane's credit and its cars waiting to enter */
+    int64_t         credit;
+    int             arbiter_waiting;
+
+#ifdef LANE_SPSC
+    /*
+     * Cars ever taken out of and put into the buffer; car n is in
+     * buffer[n % capacity]. Each counter is written by one thread only and
+     * sits on its own cache line, with that thread's waiting flag.
+     */
+    unsigned int    head __attribute__((aligned(CACHE_LINE)));
+    int             consumer_waiting;
+    unsigned int    tail __attribute__((aligned(CACHE_LINE)));
+    int             producer_waiting;
+#else
     /* index of the first element element in the list */
     int             head;
 
     /* index of the last element in the list */
     int             tail;
 
-    /* maximum number of elements in the list */
-    int             capacity;
-
     /* number of elements currently in the list */
     int             in_buf;
+#endif
 };
 
 /* complete representation of the intersection */
@@ -74,19 +143,87 @@ struct intersection {
       | Quadrant 3 | Quadrant 4 |
       +------------+------------+
                    S
-    Locks are ordered in priority 1 > 2 > 3 > 4, to avoid deadlock
+    A car is admitted once none of the quadrants on its path is occupied,
+    and takes them all at once, so cars on disjoint paths cross in parallel.
     */
-    pthread_mutex_t quad[4];
+    /* occupied quadrants, bit i for quadrant i + 1 */
+    unsigned int    occupied;
+
+    /* cross threads sleeping until a quadrant is freed */
+    int             waiting;
 
+    /* quadrants of each movement, indexed by in_dir and out_dir */
+    unsigned int    path_mask[MAX_DIRECTION][MAX_DIRECTION];
+
+    /*
+     * lanes[d] collects the cars leaving in direction d (out_cars) and is
+     * also the first entry lane from d. The entry lanes from d are
+     * entry[d * lanes_per_dir] onwards: one shared by all movements, or
+     * one each for right turns, going straight and left turns.
+     */
     struct lane       lanes[4];
+    struct lane       *entry[MAX_DIRECTION * MAX_LANES_PER_DIR];
+};
+
+/* configuration, set before init_intersection */
+extern int lane_capacity;   /* cars an entry lane holds */
+extern int lanes_per_dir;   /* entry lanes per direction, 1 or 3 */
+extern int cross_workers;   /* car_cross threads per entry lane */
+extern int cross_batch;     /* cars a car_cross thread takes at once */
+extern int ordered_out;     /* order out_cars by crossing time at the end */
+extern int des_quad_time;   /* discrete-event mode: ms to cross a quadrant */
+
+/* crossing policies (cars.c) */
+enum policy_kind {
+    POLICY_FREE,
+    POLICY_FIFO,
+    POLICY_OLDEST,
+    POLICY_WRR,
+    MAX_POLICY
 };
 
+extern enum policy_kind crossing_policy;
+extern const char *policy_names[MAX_POLICY];
+
+/* wait histograms (traffic.c) */
+void wait_hist_add(uint64_t *hist, uint64_t wait);
+void print_wait_hist(char *name, uint64_t *hist, uint64_t max, double scale, char *unit);
+
+/* bench mode (traffic -b): time the run instead of printing the cars */
+extern int bench;
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* all the cars of the schedule, allocated at once by parse_schedule */
+extern struct car *car_arena;
+extern unsigned int ncars;
+
+/* schedule reader (reader.c) */
+struct sched_reader {
+    char    *data, *p, *end;
+    size_t  size;
+};
+
+void sched_open(struct sched_reader *r, char *file_name);
+void sched_close(struct sched_reader *r);
+size_t sched_lines(struct sched_reader *r);
+int sched_line(struct sched_reader *r, long *v, int max);
+
 /* forward declaration of logic functions */
 void parse_schedule(char *f_name);
 void init_intersection();
 
 void *car_arrive(void *arg);
 void *car_cross(void *arg);
+void order_out_cars();
+int entry_index(enum direction in_dir, enum direction out_dir);
+
+/* discrete-event simulation (des.c) */
+void des_run(char *file_name);
 int *compute_path(enum direction in_dir, enum direction out_dir);
 
 #endif
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pagetable.h"
+#include "sim.h"
+
+//---------------------------------------------------------------------
+// Aging (NFU with decay). Every aging_tick references, counted over all
+// pools, the 8-bit counter of each resident page is shifted right, the
+// page's PG_REF bit is shifted in at the top and PG_REF is cleared; the
+// replay calls aging_sweep at each tick while aging_enabled is set. The
+// victim is the page with the smallest counter: the one referenced in the
+// fewest recent ticks, the most recent tick counting most. Between pages
+// with the same counter, one not referenced since the last tick goes first.
+
+unsigned aging_tick = 100;	// references between two ticks
+int aging_enabled = 0;		// some pool is managed by aging
+
+static unsigned char *counter;	// per frame
+static char aging_pools[MAX_NODES]; // pools managed by aging (split mode)
+
+/* Shifts the reference bits into the counters of the pages in the pools
+ * managed by aging.
+ */
+void aging_sweep() {
+	int i;
+	unsigned f;
+
+	for (i = 0; i < npools; i++) {
+		if (!aging_pools[i]) {
+			continue;
+		}
+		for (f = pools[i].first; f < pools[i].first + pools[i].nframes; f++) {
+			if (FRAME_EVICTABLE(f)) {
+				pgtbl_entry_t *p = coremap[f].pte;
+				counter[f] = (counter[f] >> 1) |
+					((p->frame & PG_REF) ? 0x80 : 0);
+				p->frame &= ~PG_REF;
+			}
+		}
+	}
+}
+
+/* Page to evict is chosen using the aging algorithm.
+ * Returns the page frame number (which is also the index in the coremap)
+ * for the page that is to be evicted.
+ */
+int aging_evict() {
+	int victim = -1;
+	unsigned rank, victim_rank = ~0u;
+
+	for (int i = cur_pool->first; i < cur_pool->first + cur_pool->nframes; i++) {
+		if (!FRAME_EVICTABLE(i)) {
+			continue;
+		}
+		rank = counter[i] << 1 | ((coremap[i].pte->frame & PG_REF) != 0);
+		if (rank < victim_rank) {
+			victim_rank = rank;
+			victim = i;
+		}
+	}
+	counter[victim] = 0;	// for the page that will take the frame
+	return victim;
+}
+
+/* This function is called on each access to a page to update any information
+ * needed by the aging algorithm.
+ * Input: The page table entry for the page that is being accessed.
+ */
+void aging_ref(pgtbl_entry_t *p) {
+	// A huge page is aged through its head.
+	p->frame |= PG_REF;
+}
+
+/* Initialize any data structures needed for this
+ * replacement algorithm
+ */
+void aging_init() {
+	// In split mode the other pool may run another algorithm.
+	if (counter == NULL || cur_pool == &pools[0]) {
+		free(counter);
+		counter = calloc(memsize, sizeof(unsigned char));
+		memset(aging_pools, 0, sizeof(aging_pools));
+	}
+	for (int i = cur_pool->first; i < cur_pool->first + cur_pool->nframes; ++i) {
+		counter[i] = 0;
+	}
+	aging_pools[cur_pool - pools] = 1;
+	aging_enabled = 1;
+}
+
+/* Write the counters to a snapshot.
+ */
+void aging_save(FILE *fp) {
+	snap_write(fp, aging_pools, sizeof(aging_pools));
+	snap_write(fp, counter, memsize);
+}
+
+void aging_load(FILE *fp) {
+	free(counter);
+	counter = malloc(memsize);
+	snap_read(fp, aging_pools, sizeof(aging_pools));
+	snap_read(fp, counter, memsize);
+	aging_enabled = 1;
+}
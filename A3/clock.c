@@ -12,8 +12,6 @@ extern int debug;
 
 extern struct frame *coremap;
 
-int arm_pos;	// Position of "arm" in clock.
-
 /* Page to evict is chosen using the clock algorithm.
  * Returns the page frame number (which is also the index in the coremap)
  * for the page that is to be evicted.
@@ -21,19 +19,25 @@ int arm_pos;	// Position of "arm" in clock.
 
 int clock_evict() {
 	int cnt=0;
+	int arm_pos = cur_pool->hand;	// Position of "arm" in clock.
 	while(1){
 		cnt++;
-		// Check reference bit
-		if (coremap[arm_pos].referenced == 0){
-			return arm_pos;
-		}
-		else{ //.ref == 1
-			coremap[arm_pos].referenced = 0;
+		// Check reference bit. Frames that can't be evicted are passed over.
+		if (FRAME_EVICTABLE(arm_pos)){
+			if (coremap[arm_pos].referenced == 0){
+				cur_pool->hand = arm_pos;
+				return arm_pos;
+			}
+			else{ //.ref == 1
+				coremap[arm_pos].referenced = 0;
+			}
 		}
 
 		// Update arm_pos
 		arm_pos++;
-		arm_pos %= memsize;
+		if (arm_pos == cur_pool->first + cur_pool->nframes){
+			arm_pos = cur_pool->first;
+		}
 
 	}
 
@@ -48,7 +52,7 @@ int clock_evict() {
  */
 void clock_ref(pgtbl_entry_t *p) {
 	// Set ref-bit to one.
-	int index = p -> frame >> PAGE_SHIFT;	// Get index of p
+	int index = p -> frame >> FRAME_SHIFT;	// Get index of p
 	coremap[index].referenced = 1;	// Set reference bit to 1.(no matter its previous value.)
 	return;
 }
@@ -58,8 +62,8 @@ void clock_ref(pgtbl_entry_t *p) {
  */
 void clock_init() {
 	// Initialize all ref-bit to be zero.
-	for(int i = 0; i < memsize; ++i) {
+	for(int i = cur_pool->first; i < cur_pool->first + cur_pool->nframes; ++i) {
 		coremap[i].referenced = 0;
 	}
-	arm_pos = 0;
+	cur_pool->hand = cur_pool->first;
 }
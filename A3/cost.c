@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "pagetable.h"
+
+//---------------------------------------------------------------------
+// Cost model: every reference is charged the cost of a memory access and
+// every miss the cost of servicing the fault, so that replacement
+// algorithms can be compared by modelled time rather than by miss rate.
+
+int cost_enabled = 0;
+double cost_hit = 100;		// memory access
+double cost_minor = 1000;	// fault filled by init_frame
+double cost_major = 100000;	// fault filled by swap_pagein
+double cost_writeback = 100000;	// dirty page written by swap_pageout
+unsigned cost_window = 0;	// references per reporting window, 0 for none
+
+double modelled_time = 0;
+
+// Fault latencies of the whole run and of the current window.
+static double *faults = NULL;
+static int nfaults = 0;
+static int faults_size = 0;
+static int window_first = 0;	// index in faults of the window's first fault
+static double window_start_time = 0;
+static int window_number = 0;
+
+/* Parses a list of name=cost pairs, e.g. "hit=80,major=50000". */
+void parse_costs(char *arg) {
+	char *tok;
+	char name[16];
+	double value;
+
+	for (tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (sscanf(tok, "%15[a-z]=%lf", name, &value) != 2) {
+			fprintf(stderr, "Error: invalid cost %s, expected name=cost\n", tok);
+			exit(1);
+		}
+		if (strcmp(name, "hit") == 0) {
+			cost_hit = value;
+		} else if (strcmp(name, "minor") == 0) {
+			cost_minor = value;
+		} else if (strcmp(name, "major") == 0) {
+			cost_major = value;
+		} else if (strcmp(name, "writeback") == 0) {
+			cost_writeback = value;
+		} else {
+			fprintf(stderr, "Error: unknown cost %s, expected hit, minor, major or writeback\n",
+				name);
+			exit(1);
+		}
+	}
+	cost_enabled = 1;
+}
+
+/* Records the modelled latency of one page fault. */
+void cost_record_fault(double latency) {
+	if (nfaults == faults_size) {
+		faults_size = faults_size ? faults_size * 2 : 1024;
+		faults = realloc(faults, faults_size * sizeof(double));
+		if (faults == NULL) {
+			perror("Failed to allocate fault latencies");
+			exit(1);
+		}
+	}
+	faults[nfaults++] = latency;
+}
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Returns the pth percentile (nearest rank) of the n sorted values in v. */
+static double percentile(double *v, int n, int p) {
+	int rank = (p * n + 99) / 100;
+	if (n == 0) {
+		return 0;
+	}
+	return v[rank > 0 ? rank - 1 : 0];
+}
+
+/* Prints the statistics of the window ending at the current reference. */
+void cost_window_end() {
+	int n = nfaults - window_first;
+	int refs = ref_count - window_number * cost_window;
+	double *v = &faults[window_first];
+
+	if (refs == 0) {
+		return;
+	}
+	qsort(v, n, sizeof(double), compare_double);
+	printf("Window %d: %d references, %d faults, EAT %.2f, fault p50 %.0f, p99 %.0f\n",
+	       window_number, refs, n, (modelled_time - window_start_time) / refs,
+	       percentile(v, n, 50), percentile(v, n, 99));
+
+	window_number++;
+	window_first = nfaults;
+	window_start_time = modelled_time;
+}
+
+/* Writes the modelled time and fault latencies recorded so far to a
+ * snapshot.
+ */
+void cost_save(FILE *fp) {
+	snap_write(fp, &modelled_time, sizeof(double));
+	snap_write(fp, &nfaults, sizeof(int));
+	snap_write(fp, faults, nfaults * sizeof(double));
+	snap_write(fp, &window_first, sizeof(int));
+	snap_write(fp, &window_start_time, sizeof(double));
+	snap_write(fp, &window_number, sizeof(int));
+}
+
+void cost_load(FILE *fp) {
+	snap_read(fp, &modelled_time, sizeof(double));
+	snap_read(fp, &nfaults, sizeof(int));
+	faults_size = nfaults;
+	faults = realloc(faults, nfaults * sizeof(double));
+	snap_read(fp, faults, nfaults * sizeof(double));
+	snap_read(fp, &window_first, sizeof(int));
+	snap_read(fp, &window_start_time, sizeof(double));
+	snap_read(fp, &window_number, sizeof(int));
+}
+
+void print_cost_stats() {
+	printf("\n");
+	if (cost_window != 0 && ref_count % cost_window != 0) {
+		cost_window_end(); // last partial window
+	}
+	qsort(faults, nfaults, sizeof(double), compare_double);
+	printf("Modelled time: %.0f\n", modelled_time);
+	printf("Effective access time: %.2f\n", modelled_time / ref_count);
+	printf("Fault latency p50: %.0f\n", percentile(faults, nfaults, 50));
+	printf("Fault latency p99: %.0f\n", percentile(faults, nfaults, 99));
+	printf("Fault latency max: %.0f\n", nfaults ? faults[nfaults - 1] : 0);
+}
@@ -12,19 +12,21 @@ extern int debug;
 
 extern struct frame *coremap;
 
-int oldest_page_index;
-
 /* Page to evict is chosen using the fifo algorithm.
  * Returns the page frame number (which is also the index in the coremap)
  * for the page that is to be evicted.
  */
 int fifo_evict() {
-	int evict_page_index = oldest_page_index;
-	oldest_page_index++;
+	// The pool's hand is the index of the oldest page.
+	int evict_page_index;
+	do {
+		evict_page_index = cur_pool->hand;
+		cur_pool->hand++;
 
-	if (oldest_page_index==memsize){
-		oldest_page_index=0;
-	}
+		if (cur_pool->hand==cur_pool->first + cur_pool->nframes){
+			cur_pool->hand=cur_pool->first;
+		}
+	} while (!FRAME_EVICTABLE(evict_page_index));
 
 	return evict_page_index;
 }
@@ -42,5 +44,5 @@ void fifo_ref(pgtbl_entry_t *p) {
  * replacement algorithm
  */
 void fifo_init() {
-	oldest_page_index=0;
+	cur_pool->hand=cur_pool->first;
 }
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include "pagetable.h"
+#include "sim.h"
+
+//---------------------------------------------------------------------
+// LFU with dynamic aging (LFU-DA), O(1) per reference and per eviction.
+//
+// Each page has a key: the number of references to it plus the age of its
+// pool when it was faulted in. The age of a pool is the key of the last
+// page evicted from it, so pages that were referenced often long ago but
+// not since are eventually evicted, which a plain LFU never does.
+//
+// Pages with the same key are kept in a bucket, in the order they got the
+// key, and the buckets of a pool are kept in a list sorted by key. A
+// reference moves its page to the bucket of the next key, and the victim
+// is the oldest page of the first bucket, so neither has to search. Keys
+// never go below the pool's age, so a new page's bucket (age + 1) is one
+// of the first two.
+//
+// lfu can't be simulated with threads: a reference moves the page between
+// lists.
+
+struct bucket {
+	unsigned key;
+	int head, tail;		// oldest and newest frame with this key
+	int prev, next;		// buckets with the next smaller and larger keys
+};
+
+static unsigned *key;		// key of the page in each frame, 0 if untracked
+static pgtbl_entry_t **owner;	// page the key belongs to
+static int *fprev, *fnext;	// frames of the same bucket
+static int *fbucket;		// bucket of each tracked frame
+static struct bucket *buckets;
+static int free_bucket;		// list of unused buckets, through .next
+static int *first_bucket;	// bucket with the smallest key, per pool
+static unsigned *age;		// per pool
+
+/* Allocates the lists of all pools, empty. */
+static void lfu_alloc() {
+	int i;
+	int nbuckets = memsize + npools;	// one spare per pool, see lfu_ref
+
+	free(key); free(owner); free(fprev); free(fnext); free(fbucket);
+	free(buckets); free(first_bucket); free(age);
+	key = calloc(memsize, sizeof(unsigned));
+	owner = calloc(memsize, sizeof(pgtbl_entry_t *));
+	fprev = malloc(memsize * sizeof(int));
+	fnext = malloc(memsize * sizeof(int));
+	fbucket = malloc(memsize * sizeof(int));
+	buckets = malloc(nbuckets * sizeof(struct bucket));
+	first_bucket = malloc(npools * sizeof(int));
+	age = calloc(npools, sizeof(unsigned));
+	if (key == NULL || owner == NULL || fprev == NULL || fnext == NULL ||
+	    fbucket == NULL || buckets == NULL || first_bucket == NULL ||
+	    age == NULL) {
+		perror("Failed to allocate lfu state");
+		exit(1);
+	}
+	for (i = 0; i < nbuckets; i++) {
+		buckets[i].next = i + 1 < nbuckets ? i + 1 : -1;
+	}
+	free_bucket = 0;
+	for (i = 0; i < npools; i++) {
+		first_bucket[i] = -1;
+	}
+}
+
+/* Returns the bucket for key k that follows bucket prev (-1 for the start
+ * of the pool's list), creating it if needed.
+ */
+static int bucket_after(int pool, int prev, unsigned k) {
+	int next = (prev == -1) ? first_bucket[pool] : buckets[prev].next;
+	int b;
+
+	if (next != -1 && buckets[next].key == k) {
+		return next;
+	}
+	b = free_bucket;
+	assert(b != -1);
+	free_bucket = buckets[b].next;
+	buckets[b].key = k;
+	buckets[b].head = buckets[b].tail = -1;
+	buckets[b].prev = prev;
+	buckets[b].next = next;
+	if (prev == -1) {
+		first_bucket[pool] = b;
+	} else {
+		buckets[prev].next = b;
+	}
+	if (next != -1) {
+		buckets[next].prev = b;
+	}
+	return b;
+}
+
+static void append(int b, int frame) {
+	fbucket[frame] = b;
+	fprev[frame] = buckets[b].tail;
+	fnext[frame] = -1;
+	if (buckets[b].tail == -1) {
+		buckets[b].head = frame;
+	} else {
+		fnext[buckets[b].tail] = frame;
+	}
+	buckets[b].tail = frame;
+}
+
+/* Takes frame out of its bucket, and the bucket out of the list if it is
+ * now empty.
+ */
+static void unlink_frame(int pool, int frame) {
+	int b = fbucket[frame];
+
+	if (fprev[frame] == -1) {
+		buckets[b].head = fnext[frame];
+	} else {
+		fnext[fprev[frame]] = fnext[frame];
+	}
+	if (fnext[frame] == -1) {
+		buckets[b].tail = fprev[frame];
+	} else {
+		fprev[fnext[frame]] = fprev[frame];
+	}
+
+	if (buckets[b].head == -1) {
+		if (buckets[b].prev == -1) {
+			first_bucket[pool] = buckets[b].next;
+		} else {
+			buckets[buckets[b].prev].next = buckets[b].next;
+		}
+		if (buckets[b].next != -1) {
+			buckets[buckets[b].next].prev = buckets[b].prev;
+		}
+		buckets[b].next = free_bucket;
+		free_bucket = b;
+	}
+	key[frame] = 0;
+}
+
+/* Page to evict is chosen using LFU with dynamic aging.
+ * Returns the page frame number (which is also the index in the coremap)
+ * for the page that is to be evicted.
+ */
+int lfu_evict() {
+	int pool = cur_pool - pools;
+	int frame, i;
+
+	while (first_bucket[pool] != -1) {
+		frame = buckets[first_bucket[pool]].head;
+		if (FRAME_EVICTABLE(frame)) {
+			age[pool] = key[frame];
+			unlink_frame(pool, frame);
+			return frame;
+		}
+		// Became the tail of a huge page; the head stands for it now.
+		unlink_frame(pool, frame);
+	}
+
+	// Only pages never referenced since they were split off a huge page
+	// are left.
+	for (i = cur_pool->first; i < cur_pool->first + cur_pool->nframes; i++) {
+		if (FRAME_EVICTABLE(i)) {
+			return i;
+		}
+	}
+	return cur_pool->first;
+}
+
+/* This function is called on each access to a page to update any information
+ * needed by the lfu algorithm.
+ * Input: The page table entry for the page that is being accessed.
+ */
+void lfu_ref(pgtbl_entry_t *p) {
+	int frame = p->frame >> FRAME_SHIFT;
+	int pool = coremap[frame].pool;
+	int b, prev;
+
+	if (key[frame] != 0 && owner[frame] != p) {
+		// The frame was reused without being chosen as a victim (it
+		// was a subpage of an evicted huge page).
+		unlink_frame(pool, frame);
+	}
+
+	if (key[frame] == 0) {
+		// A new page, with key age + 1: skip the bucket of key age, if
+		// there is one.
+		prev = first_bucket[pool];
+		if (prev == -1 || buckets[prev].key > age[pool]) {
+			prev = -1;
+		}
+		b = bucket_after(pool, prev, age[pool] + 1);
+		append(b, frame);
+		key[frame] = age[pool] + 1;
+		owner[frame] = p;
+		return;
+	}
+
+	// Usually one reference, and the page moves to the next bucket; with
+	// run-length replay a call can stand for several (see repeat_hit).
+	prev = fbucket[frame];
+	while (buckets[prev].next != -1 &&
+	       buckets[buckets[prev].next].key < key[frame] + ref_weight) {
+		prev = buckets[prev].next;
+	}
+	// The new bucket is made before the frame leaves its own, which may
+	// then be freed; hence the spare bucket per pool.
+	b = bucket_after(pool, prev, key[frame] + ref_weight);
+	unlink_frame(pool, frame);
+	append(b, frame);
+	key[frame] = buckets[b].key;
+}
+
+/* Initialize any data structures needed for this
+ * replacement algorithm
+ */
+void lfu_init() {
+	int i;
+
+	// In split mode the other pool may run another algorithm.
+	if (key == NULL || cur_pool == &pools[0]) {
+		lfu_alloc();
+	}
+	for (i = cur_pool->first; i < cur_pool->first + cur_pool->nframes; i++) {
+		key[i] = 0;
+	}
+}
+
+/* Write the age of each pool and its pages in list order (bucket by
+ * bucket, oldest first) with their keys to a snapshot.
+ */
+void lfu_save(FILE *fp) {
+	int i, b, frame, end = -1;
+
+	for (i = 0; i < npools; i++) {
+		snap_write(fp, &age[i], sizeof(unsigned));
+		for (b = first_bucket[i]; b != -1; b = buckets[b].next) {
+			for (frame = buckets[b].head; frame != -1; frame = fnext[frame]) {
+				snap_write(fp, &frame, sizeof(int));
+				snap_write(fp, &key[frame], sizeof(unsigned));
+			}
+		}
+		snap_write(fp, &end, sizeof(int));
+	}
+}
+
+void lfu_load(FILE *fp) {
+	int i, frame, prev;
+	unsigned k;
+
+	lfu_alloc();
+	for (i = 0; i < npools; i++) {
+		snap_read(fp, &age[i], sizeof(unsigned));
+		prev = -1;
+		while (snap_read(fp, &frame, sizeof(int)), frame != -1) {
+			snap_read(fp, &k, sizeof(unsigned));
+			if (prev == -1 || buckets[prev].key != k) {
+				prev = bucket_after(i, prev, k);
+			}
+			append(prev, frame);
+			key[frame] = k;
+			owner[frame] = coremap[frame].pte;
+		}
+	}
+}
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sim.h"
+#include "pagetable.h"
+
+//---------------------------------------------------------------------
+// Lockstep comparisons, for debugging replacement algorithms. Two
+// simulations of the loaded trace run side by side, each in its own process
+// (the simulation state is global), and report every reference to the
+// parent through a pipe: whether it missed and which page the algorithm
+// chose to evict. The parent reads the two reports of each reference
+// together.
+//
+// -K k replays each algorithm with memsize and memsize + k frames and flags
+// the references after which the larger memory has had more misses
+// (Belady's anomaly). -V n replays two algorithms with the same memory and
+// logs the first n references where they part ways: one hits and the other
+// misses, or both miss but evict different pages.
+
+#define MAX_ANOMALY_LOG 10
+
+struct step {
+	addr_t victim;		// page evicted first, if evicted is set
+	char miss;
+	char evicted;
+};
+
+static struct step step;	// the reference being simulated (children)
+static int (*real_evict)();
+
+static int lockstep_evict() {
+	int frame = real_evict();
+
+	if (!step.evicted) {
+		step.evicted = 1;
+		step.victim = coremap[frame].address;
+	}
+	return frame;
+}
+
+/*
+ * Forks a simulation of the trace with alg and memory frames, which writes
+ * a struct step per reference to the returned stream.
+ */
+static FILE *start_side(char *alg, unsigned frames, pid_t *pid) {
+	int fds[2];
+	FILE *fp;
+	size_t i;
+
+	if (pipe(fds) == -1 || (*pid = fork()) == -1) {
+		perror("Failed to start a lockstep simulation");
+		exit(1);
+	}
+	if (*pid != 0) {
+		close(fds[1]);
+		if ((fp = fdopen(fds[0], "r")) == NULL) {
+			perror("fdopen");
+			exit(1);
+		}
+		setvbuf(fp, NULL, _IOFBF, 1 << 16);
+		return fp;
+	}
+
+	close(fds[0]);
+	if ((fp = fdopen(fds[1], "w")) == NULL) {
+		perror("fdopen");
+		exit(1);
+	}
+	setvbuf(fp, NULL, _IOFBF, 1 << 16);
+	memsize = frames;
+	start_simulation(alg);
+	real_evict = evict_fcn;
+	evict_fcn = lockstep_evict;
+	for (i = 0; i < trace.nrefs; i++) {
+		int misses = miss_count;
+		ref_t ref = trace.refs[i];
+
+		step.evicted = 0;
+		access_mem(REF_TYPE(ref), REF_ADDR(ref));
+		step.miss = (miss_count != misses);
+		if (fwrite(&step, sizeof(step), 1, fp) != 1) {
+			exit(1);	// the parent stopped reading
+		}
+	}
+	fclose(fp);
+	swap_destroy();
+	exit(0);
+}
+
+/* Reads the next step of both sides; returns 0 at the end of the trace. */
+static int next_steps(FILE *a, FILE *b, struct step *sa, struct step *sb) {
+	return fread(sa, sizeof(*sa), 1, a) == 1 &&
+		fread(sb, sizeof(*sb), 1, b) == 1;
+}
+
+static void finish_sides(FILE *a, FILE *b, pid_t pa, pid_t pb) {
+	int status;
+
+	fclose(a);
+	fclose(b);
+	if (waitpid(pa, &status, 0) == -1 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0 ||
+	    waitpid(pb, &status, 0) == -1 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "Error: lockstep simulation failed\n");
+		exit(1);
+	}
+}
+
+/*
+ * Replays alg with memsize and memsize + extra frames in lockstep and
+ * reports where the larger memory is behind: each stretch of references
+ * after which it has had more misses, and how far behind it got.
+ */
+void lockstep_belady(char *alg, unsigned extra) {
+	unsigned small = memsize, large = memsize + extra;
+	pid_t pa, pb;
+	FILE *a = start_side(alg, small, &pa);
+	FILE *b = start_side(alg, large, &pb);
+	struct step sa, sb;
+	size_t i, behind = 0, stretches = 0, worst_at = 0;
+	long ma = 0, mb = 0, worst = 0;
+	int was_behind = 0;
+
+	for (i = 0; next_steps(a, b, &sa, &sb); i++) {
+		ma += sa.miss;
+		mb += sb.miss;
+		if (mb > ma) {
+			behind++;
+			if (!was_behind && stretches++ < MAX_ANOMALY_LOG) {
+				printf("Anomaly from reference %zu (%c 0x%lx): %ld misses "
+				       "with %u frames, %ld with %u\n", i,
+				       REF_TYPE(trace.refs[i]), REF_ADDR(trace.refs[i]),
+				       mb, large, ma, small);
+			}
+			if (mb - ma > worst) {
+				worst = mb - ma;
+				worst_at = i;
+			}
+		}
+		was_behind = (mb > ma);
+	}
+	finish_sides(a, b, pa, pb);
+
+	printf("%s: %ld misses with %u frames, %ld with %u frames\n", alg,
+	       ma, small, mb, large);
+	if (stretches == 0) {
+		printf("No anomaly: %u frames never had more misses than %u\n",
+		       large, small);
+	} else {
+		printf("Belady's anomaly: %u frames had more misses after %zu of "
+		       "%zu references, in %zu stretches; at most %ld more, at "
+		       "reference %zu\n", large, behind, i, stretches, worst,
+		       worst_at);
+	}
+}
+
+static void print_side(char *alg, struct step *s) {
+	if (!s->miss) {
+		printf("%s hit", alg);
+	} else if (s->evicted) {
+		printf("%s missed, evicted 0x%lx", alg, s->victim);
+	} else {
+		printf("%s missed", alg);
+	}
+}
+
+/*
+ * Replays alg1 and alg2 in lockstep and logs the first nlog references
+ * where they diverge, with what each did.
+ */
+void lockstep_diverge(char *alg1, char *alg2, int nlog) {
+	pid_t pa, pb;
+	FILE *a = start_side(alg1, memsize, &pa);
+	FILE *b = start_side(alg2, memsize, &pb);
+	struct step sa, sb;
+	size_t i, diverged = 0;
+	long ma = 0, mb = 0;
+
+	for (i = 0; next_steps(a, b, &sa, &sb); i++) {
+		ma += sa.miss;
+		mb += sb.miss;
+		if (sa.miss == sb.miss && sa.evicted == sb.evicted &&
+		    (!sa.evicted || sa.victim == sb.victim)) {
+			continue;
+		}
+		if (diverged++ < nlog) {
+			printf("Divergence %zu at reference %zu (%c 0x%lx): ", diverged,
+			       i, REF_TYPE(trace.refs[i]), REF_ADDR(trace.refs[i]));
+			print_side(alg1, &sa);
+			printf("; ");
+			print_side(alg2, &sb);
+			printf("\n");
+		}
+	}
+	finish_sides(a, b, pa, pb);
+
+	printf("%s: %ld misses, %s: %ld misses\n", alg1, ma, alg2, mb);
+	printf("Divergent references: %zu of %zu\n", diverged, i);
+}
@@ -4,10 +4,9 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include "pagetable.h"
+#include "sim.h"
 
 
-extern int memsize;
-
 extern int debug;
 
 extern struct frame *coremap;
@@ -26,8 +25,8 @@ int lru_evict() {
 	int least_ref_page_index;
 	int least_ref_time = ref_time;	
 
-	for (int i=0; i<memsize; i++){
-		if (coremap[i].timestamp<least_ref_time){	
+	for (int i=cur_pool->first; i<cur_pool->first + cur_pool->nframes; i++){
+		if (FRAME_EVICTABLE(i) && coremap[i].timestamp<least_ref_time){	
 			least_ref_time = coremap[i].timestamp;
 			least_ref_page_index = i;
 		}
@@ -41,9 +40,10 @@ int lru_evict() {
  * Input: The page table entry for the page that is being accessed.
  */
 void lru_ref(pgtbl_entry_t *p) {
-	// Refresh timestamp, increment reference time ref_time;
-	coremap[p -> frame >> PAGE_SHIFT].timestamp = ref_time;
-	ref_time++;
+	// Refresh timestamp, increment reference time ref_time; atomically, as
+	// threads may reference pages concurrently.
+	coremap[p -> frame >> FRAME_SHIFT].timestamp =
+		__atomic_fetch_add(&ref_time, 1, __ATOMIC_RELAXED);
 
 	return;
 }
@@ -54,10 +54,20 @@ void lru_ref(pgtbl_entry_t *p) {
  */
 void lru_init() {
 	// Initialize all timestamp to be zero
-	for(int i = 0; i < memsize; ++i) {
+	for(int i = cur_pool->first; i < cur_pool->first + cur_pool->nframes; ++i) {
 		coremap[i].timestamp = 0;
 	}
 
 	ref_time = 0;//lowerBoundOf_ref_time = 0;
 	return;
 }
+
+/* Write the reference time to a snapshot; the timestamps are in the coremap.
+ */
+void lru_save(FILE *fp) {
+	snap_write(fp, &ref_time, sizeof(int));
+}
+
+void lru_load(FILE *fp) {
+	snap_read(fp, &ref_time, sizeof(int));
+}
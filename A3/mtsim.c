@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "sim.h"
+#include "pagetable.h"
+
+//---------------------------------------------------------------------
+// Multi-threaded simulation. mt_threads threads each replay a trace
+// against one shared page table, coremap, physmem and swap, like the
+// threads of one process.
+//
+// Hits take no lock: a thread pins the frame, checks that the page table
+// entry still maps it and sets PG_REF/PG_DIRTY with an atomic or. The
+// evictor clears PG_VALID before it looks at the pins, so either it sees
+// the pin and puts the page back, or the thread sees the entry invalid and
+// takes the slow path.
+//
+// Faults take a lock on the entry (striped by address). Eviction is done
+// by one thread at a time under evict_lock, reclaim_batch frames at a
+// time, into a free list the faulting threads allocate from. The evictor
+// only trylocks the entries of its victims, so it never waits for a
+// faulting thread.
+
+extern pgdir_entry_t *pgdir;
+extern pgdir_entry_t init_second_level();
+extern void init_frame(int frame, addr_t vaddr);
+
+#define PTE_LOCKS 1024		// number of striped page table entry locks
+
+int mt_threads = 0;		// 0 for the single-threaded simulation
+int reclaim_batch = 1;		// frames evicted at once when memory is full
+int batch_reclaim = 0;
+
+struct mt_thread {
+	pthread_t tid;
+	struct trace *trace;
+	long refs, hits, misses;
+	long evict_clean, evict_dirty;
+	long reclaims;		// batches of evictions done by this thread
+	double evict_wait;	// seconds spent waiting for evict_lock
+	double seconds;		// time to replay the whole trace
+} __attribute__((aligned(64)));	// one cache line each, no false sharing
+
+static pthread_mutex_t pte_locks[PTE_LOCKS];
+static pthread_mutex_t evict_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t start_barrier;
+static int *free_frames;	// stack of free frame numbers
+static int nfree;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static pthread_mutex_t *pte_lock(pgtbl_entry_t *p) {
+	return &pte_locks[((uintptr_t)p / sizeof(pgtbl_entry_t)) % PTE_LOCKS];
+}
+
+/*
+ * Returns the page table entry for vaddr, creating its second-level page
+ * table if needed. Threads racing to create the same table agree on one
+ * with a compare-and-swap on the directory entry.
+ */
+static pgtbl_entry_t *mt_lookup(addr_t vaddr) {
+	unsigned idx = PGDIR_INDEX(vaddr);
+	uintptr_t pde = __atomic_load_n(&pgdir[idx].pde, __ATOMIC_ACQUIRE);
+
+	if ((pde & PG_VALID) == 0) {
+		pgdir_entry_t new_entry = init_second_level();
+		uintptr_t expected = 0;
+		if (__atomic_compare_exchange_n(&pgdir[idx].pde, &expected,
+						new_entry.pde, 0, __ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			pde = new_entry.pde;
+			__atomic_fetch_add(&pgtbl_count, 1, __ATOMIC_RELAXED);
+		} else {
+			free((void *)(new_entry.pde & PDE_MASK));
+			pde = expected;
+		}
+	}
+	return (pgtbl_entry_t *)(pde & PDE_MASK) + PGTBL_INDEX(vaddr);
+}
+
+/*
+ * Evicts up to reclaim_batch pages chosen by evict_fcn and puts their
+ * frames on the free list. Called with evict_lock held. Victims that are
+ * pinned, or whose entry is locked by a faulting thread, are passed over
+ * and reported to the algorithm as referenced so it chooses another one.
+ */
+static void mt_reclaim(struct mt_thread *t) {
+	int victims[MAX_RECLAIM_BATCH];
+	int n = 0, attempts = 0;
+
+	cur_pool = &pools[0];
+	while (n < reclaim_batch && (n == 0 || attempts < 4 * (int)memsize)) {
+		int frame = evict_fcn();
+		pgtbl_entry_t *p = coremap[frame].pte;
+		pthread_mutex_t *lock = pte_lock(p);
+		unsigned old, pte;
+		int swap_offset;
+
+		attempts++;
+		if (pthread_mutex_trylock(lock) != 0) {
+			ref_fcn(p);
+			continue;
+		}
+		old = __atomic_fetch_and(&p->frame, ~PG_VALID, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&coremap[frame].pins, __ATOMIC_SEQ_CST) != 0) {
+			__atomic_fetch_or(&p->frame, PG_VALID, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(lock);
+			ref_fcn(p);
+			continue;
+		}
+		// The frame is ours now; keep the algorithm from choosing it
+		// again for this batch.
+		coremap[frame].in_use = 0;
+
+		swap_offset = swap_pageout(frame, p->swap_off);
+		if (swap_offset == INVALID_SWAP) {
+			perror("Swap Error.\n");
+			exit(1);
+		}
+		p->swap_off = swap_offset;
+		pte = old & ~(PG_VALID | PG_DIRTY);
+		if (old & PG_DIRTY) {
+			pte |= PG_ONSWAP;
+			t->evict_dirty++;
+		} else {
+			t->evict_clean++;
+		}
+		__atomic_store_n(&p->frame, pte, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(lock);
+		victims[n++] = frame;
+	}
+
+	pthread_mutex_lock(&free_lock);
+	while (n > 0) {
+		free_frames[nfree++] = victims[--n];
+	}
+	pthread_mutex_unlock(&free_lock);
+	t->reclaims++;
+}
+
+/*
+ * Takes a frame off the free list, reclaiming a batch of frames first if
+ * the list is empty.
+ */
+static int mt_get_frame(struct mt_thread *t) {
+	int frame;
+	double start;
+
+	while (1) {
+		pthread_mutex_lock(&free_lock);
+		if (nfree > 0) {
+			frame = free_frames[--nfree];
+			pthread_mutex_unlock(&free_lock);
+			return frame;
+		}
+		pthread_mutex_unlock(&free_lock);
+
+		start = now();
+		pthread_mutex_lock(&evict_lock);
+		t->evict_wait += now() - start;
+		// Another thread may have refilled the list while we waited.
+		pthread_mutex_lock(&free_lock);
+		frame = nfree;
+		pthread_mutex_unlock(&free_lock);
+		if (frame == 0) {
+			mt_reclaim(t);
+		}
+		pthread_mutex_unlock(&evict_lock);
+	}
+}
+
+/*
+ * Multi-threaded find_physpage: returns the frame holding vaddr, pinned,
+ * faulting the page in if needed. The caller unpins the frame once it is
+ * done with the page's memory.
+ */
+static int mt_find_physpage(struct mt_thread *t, addr_t vaddr, char type) {
+	pgtbl_entry_t *p = mt_lookup(vaddr);
+	unsigned set = PG_REF;
+	unsigned pte;
+	int frame;
+
+	if (type == 'M' || type == 'S') {
+		set |= PG_DIRTY;
+	}
+
+	while (1) {
+		// Fast path, lock-free: pin the frame and check it still holds
+		// the page.
+		pte = __atomic_load_n(&p->frame, __ATOMIC_ACQUIRE);
+		if (pte & PG_VALID) {
+			frame = pte >> FRAME_SHIFT;
+			__atomic_fetch_add(&coremap[frame].pins, 1, __ATOMIC_SEQ_CST);
+			pte = __atomic_load_n(&p->frame, __ATOMIC_SEQ_CST);
+			if ((pte & PG_VALID) && (pte >> FRAME_SHIFT) == frame) {
+				__atomic_fetch_or(&p->frame, set, __ATOMIC_RELAXED);
+				t->hits++;
+				ref_fcn(p);
+				return frame;
+			}
+			__atomic_fetch_sub(&coremap[frame].pins, 1, __ATOMIC_SEQ_CST);
+		}
+
+		// Slow path: fault the page in under the entry's lock, unless
+		// another thread did it first.
+		pthread_mutex_t *lock = pte_lock(p);
+		pthread_mutex_lock(lock);
+		pte = __atomic_load_n(&p->frame, __ATOMIC_ACQUIRE);
+		if (pte & PG_VALID) {
+			pthread_mutex_unlock(lock);
+			continue;
+		}
+
+		frame = mt_get_frame(t);
+		coremap[frame].pte = p;
+		coremap[frame].address = vaddr & PAGE_MASK;
+		// A thread with a stale entry may still hold a pin on the
+		// frame for a moment; add ours to it.
+		__atomic_fetch_add(&coremap[frame].pins, 1, __ATOMIC_SEQ_CST);
+		if (pte & PG_ONSWAP) {
+			if (swap_pagein(frame, p->swap_off) != 0) {
+				perror("Error in swap_pagein.\n");
+				exit(1);
+			}
+			pte = (frame << FRAME_SHIFT) | PG_ONSWAP;
+		} else {
+			init_frame(frame, vaddr);
+			__atomic_fetch_add(&pgtbl_live[PGDIR_INDEX(vaddr)], 1,
+					   __ATOMIC_RELAXED);
+			pte = (frame << FRAME_SHIFT) | PG_ONSWAP | PG_DIRTY;
+		}
+		__atomic_store_n(&p->frame, pte | set | PG_VALID, __ATOMIC_RELEASE);
+		__atomic_store_n(&coremap[frame].in_use, 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(lock);
+
+		t->misses++;
+		ref_fcn(p);
+		return frame;
+	}
+}
+
+/* Thread body: replay one trace, like replay_trace and access_mem. */
+static void *mt_replay(void *arg) {
+	struct mt_thread *t = arg;
+	size_t i;
+	double start;
+
+	pthread_barrier_wait(&start_barrier);
+	start = now();
+
+	for (i = 0; i < t->trace->nrefs; i++) {
+		char type = REF_TYPE(t->trace->refs[i]);
+		addr_t vaddr = REF_ADDR(t->trace->refs[i]);
+
+		int frame = mt_find_physpage(t, vaddr, type);
+		char *memptr = &physmem[frame * SIMPAGESIZE];
+		addr_t *checkaddr = (addr_t *)(memptr + sizeof(int));
+
+		if (*checkaddr != (vaddr & PAGE_MASK)) {
+			fprintf(stderr,"Error, simulated page returned by pagetable lookup doese not have expected value.\n");
+		}
+		if (type == 'S' || type == 'M') {
+			__atomic_fetch_add((int *)memptr, 1, __ATOMIC_RELAXED);
+		}
+		__atomic_fetch_sub(&coremap[frame].pins, 1, __ATOMIC_RELEASE);
+		t->refs++;
+	}
+
+	t->seconds = now() - start;
+	return NULL;
+}
+
+/* Replays the traces in the comma-separated list tracefile with
+ * mt_threads threads (thread i replays trace i modulo the number of
+ * traces) and prints the results, with per-thread throughput.
+ */
+void mt_simulate(char *alg) {
+	int i, ntraces = 0;
+	char *names[64];
+	struct trace traces[64];
+	char *list = strdup(tracefile);
+	struct mt_thread *threads;
+	double start, wall;
+	long reclaims = 0;
+	double evict_wait = 0;
+
+	for (names[0] = strtok(list, ","); names[ntraces] != NULL && ntraces < 63;
+	     names[++ntraces] = strtok(NULL, ","))
+		;
+	for (i = 0; i < ntraces; i++) {
+		trace_load(&traces[i], names[i]);
+	}
+
+	coremap = calloc(memsize, sizeof(struct frame));
+	physmem = malloc(memsize * SIMPAGESIZE);
+	init_pools();
+	swap_init(swapsize);
+	init_pagetable();
+	free_frames = malloc(memsize * sizeof(int));
+	for (i = 0; i < memsize; i++) {
+		free_frames[i] = memsize - 1 - i; // frame 0 is handed out first
+	}
+	nfree = memsize;
+	for (i = 0; i < PTE_LOCKS; i++) {
+		pthread_mutex_init(&pte_locks[i], NULL);
+	}
+
+	select_alg(alg);
+	cur_pool = &pools[0];
+	init_fcn();
+
+	threads = calloc(mt_threads, sizeof(struct mt_thread));
+	pthread_barrier_init(&start_barrier, NULL, mt_threads + 1);
+	for (i = 0; i < mt_threads; i++) {
+		threads[i].trace = &traces[i % ntraces];
+		if (pthread_create(&threads[i].tid, NULL, mt_replay, &threads[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	start = now();
+	for (i = 0; i < mt_threads; i++) {
+		pthread_join(threads[i].tid, NULL);
+	}
+	wall = now() - start;
+
+	for (i = 0; i < mt_threads; i++) {
+		hit_count += threads[i].hits;
+		miss_count += threads[i].misses;
+		ref_count += threads[i].refs;
+		evict_clean_count += threads[i].evict_clean;
+		evict_dirty_count += threads[i].evict_dirty;
+		reclaims += threads[i].reclaims;
+		evict_wait += threads[i].evict_wait;
+	}
+
+	print_pagedirectory();
+	swap_destroy();
+	print_stats();
+
+	printf("\n");
+	for (i = 0; i < mt_threads; i++) {
+		struct mt_thread *t = &threads[i];
+		printf("Thread %d: %ld references, %ld hits, %ld misses, %.3f s, "
+		       "%.2f Mrefs/s\n", i, t->refs, t->hits, t->misses, t->seconds,
+		       t->seconds > 0 ? t->refs / t->seconds / 1e6 : 0.0);
+	}
+	printf("Threads: %d\n", mt_threads);
+	printf("Wall time: %.3f s\n", wall);
+	printf("Throughput: %.2f Mrefs/s\n", wall > 0 ? ref_count / wall / 1e6 : 0.0);
+	printf("Reclaim batches: %ld\n", reclaims);
+	printf("Evict lock wait: %.3f s\n", evict_wait);
+	for (i = 0; i < ntraces; i++) {
+		free(traces[i].refs);
+	}
+	free(list);
+}
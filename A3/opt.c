@@ -13,36 +13,32 @@ extern int debug;
 extern struct frame *coremap;
 
 
-struct linked_ref{
-	addr_t addr;	
-	struct linked_ref *next;
-};
-
-struct linked_ref *current_ref;
-
-
 /* Page to evict is chosen using the optimal (aka MIN) algorithm.
  * Returns the page frame number (which is also the index in the coremap)
  * for the page that is to be evicted.
  */
 int opt_evict() {
-	int longest_unuse_page_index = 0;
+	int longest_unuse_page_index = cur_pool->first;
 	int longest_unuse_page_refCount = 0;
-	struct linked_ref *next_ref = NULL;
+	size_t next_ref;
 
-	for (int i=0; i<memsize; i++){
+	for (int i=cur_pool->first; i<cur_pool->first + cur_pool->nframes; i++){
 		int gap_to_future_reference = 0;
-		next_ref = current_ref;
+		if (!FRAME_EVICTABLE(i))
+			continue;
+		// ref_count is the index in the trace of the reference being
+		// faulted in.
+		next_ref = ref_count;
 
 		// Find the nearest use in the future. Note: If won't be used in future, choose of victim.
-		while(next_ref->addr != coremap[i].address){
-			// End of linked list
-			if (next_ref->next == NULL){
+		while((REF_ADDR(trace.refs[next_ref]) & PAGE_MASK) != coremap[i].address){
+			// End of trace
+			if (next_ref + 1 >= trace.nrefs){
 				return i;
 			}
-			// Check next node in linked list.
+			// Check next reference in trace.
 			gap_to_future_reference++;
-			next_ref = next_ref->next;
+			next_ref++;
 		}
 
 		// Compare and update.
@@ -60,8 +56,9 @@ int opt_evict() {
  * Input: The page table entry for the page that is being accessed.
  */
 void opt_ref(pgtbl_entry_t *p) {
-	// Simply go to the next node of linked list.
-	current_ref = current_ref->next;
+	// Nothing to do: the position in the trace is ref_count, which stays
+	// right with run-length replay and when opt manages only one pool of
+	// a split memory.
 	return;
 }
 
@@ -69,48 +66,14 @@ void opt_ref(pgtbl_entry_t *p) {
  * replacement algorithm.
  */
 void opt_init() {
-	// Create a linked list of reference from tracefile
-	// Initializes current_ref
-	current_ref = NULL;
-
-	// Open tracefile, the tracefile entry is from "sim.h" line 24.
-	FILE *fp;
-	if((fp = fopen(tracefile, "r")) == NULL) {
-		perror("Error opening tracefile.\n");
-		exit(1);
-	}
-
-	// Create linked list of reference, one line = one reference
-	char buffer[MAXLINE];
-	addr_t address = 0;
-	char ref_type;
-	//struct linked_ref *current = NULL;
-	struct linked_ref *next = NULL;
-
-	while(fgets(buffer, MAXLINE, fp) != NULL) {
-		// Check first char, shouldn't be "="
-		if (buffer[0] == '=')
-			continue;
-
-		// Extract information
-		sscanf(buffer, "%c %lx", &ref_type, &address);
-
-		// Create new node in linked list
-		struct linked_ref *new_ref = malloc(sizeof(struct linked_ref));
-		new_ref->addr = address;
-		new_ref->next = NULL;
-		if(!(current_ref == NULL)){
-			next->next = new_ref;
-			next = new_ref;
-		}
-		else{
-			current_ref = new_ref;
-			next = new_ref;
-		}
-
-	}
-
+	// The future references are the loaded trace (see "sim.h"), read from
+	// the reference being simulated on.
+	return;
+}
 
-	// Close file, end of task.
-	fclose(fp);
+/* The position in the trace is not saved in snapshots, it is the number
+ * of references already replayed.
+ */
+void opt_load(FILE *fp) {
+	opt_init();
 }
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <assert.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include "pagetable.h"
+#include "sim.h"
+
+//---------------------------------------------------------------------
+// OPT with a bounded lookahead. Instead of the whole future, optw only sees
+// the next optw_window references (see trace_ahead), so it works on a
+// streamed trace (-z) of any length. Among the resident pages it evicts
+// one not referenced within the window, or else the one whose next
+// reference is furthest away. With a window as long as the trace it
+// chooses the same victims as opt.
+
+extern pgdir_entry_t *pgdir;
+
+unsigned optw_window = 1000;
+
+static unsigned *seen;		// eviction at which dist was set, per frame
+static unsigned *dist;		// distance to the frame's next reference
+static unsigned evictions;
+
+/* Returns the frame whose eviction would take out the resident page of
+ * vaddr, or -1 if the page is not resident. Evicting a huge page takes out
+ * all of its subpages if thp_demote is THP_DEMOTE_EVICT; if it is split
+ * instead, only the head subpage goes.
+ */
+static int resident_frame(addr_t vaddr) {
+	uintptr_t pde = pgdir[PGDIR_INDEX(vaddr)].pde;
+	pgtbl_entry_t *p;
+
+	if ((pde & PG_VALID) == 0) {
+		return -1;
+	}
+	p = (pgtbl_entry_t *)(pde & PDE_MASK) + PGTBL_INDEX(vaddr);
+	if ((p->frame & PG_VALID) == 0) {
+		return -1;
+	}
+	if ((p->frame & PG_HUGE) && thp_demote == THP_DEMOTE_EVICT) {
+		p -= PGTBL_INDEX(vaddr) & HPAGE_INDEX_MASK;
+	}
+	return p->frame >> FRAME_SHIFT;
+}
+
+/* Page to evict is chosen using OPT within the lookahead window.
+ * Returns the page frame number (which is also the index in the coremap)
+ * for the page that is to be evicted.
+ */
+int optw_evict() {
+	int victim = -1;
+	unsigned i, victim_dist = 0;
+	ref_t ref;
+
+	// One pass over the window finds the next reference to each resident
+	// page.
+	evictions++;
+	for (i = 0; i <= optw_window && trace_ahead(i, &ref); i++) {
+		int frame = resident_frame(REF_ADDR(ref));
+		if (frame != -1 && seen[frame] != evictions) {
+			seen[frame] = evictions;
+			dist[frame] = i;
+		}
+	}
+
+	for (int f = cur_pool->first; f < cur_pool->first + cur_pool->nframes; f++) {
+		if (!FRAME_EVICTABLE(f)) {
+			continue;
+		}
+		if (seen[f] != evictions) {
+			return f;	// not referenced within the window
+		}
+		if (victim == -1 || dist[f] > victim_dist) {
+			victim = f;
+			victim_dist = dist[f];
+		}
+	}
+	return victim;
+}
+
+/* This function is called on each access to a page to update any information
+ * needed by the optw algorithm.
+ * Input: The page table entry for the page that is being accessed.
+ */
+void optw_ref(pgtbl_entry_t *p) {
+	return;
+}
+
+/* Initializes any data structures needed for this
+ * replacement algorithm.
+ */
+void optw_init() {
+	// In split mode the other pool may run another algorithm.
+	if (seen == NULL || cur_pool == &pools[0]) {
+		free(seen);
+		free(dist);
+		seen = calloc(memsize, sizeof(unsigned));
+		dist = calloc(memsize, sizeof(unsigned));
+		evictions = 0;
+	}
+}
+
+/* There is no state to restore besides the arrays. */
+void optw_load(FILE *fp) {
+	cur_pool = &pools[0];
+	optw_init();
+}
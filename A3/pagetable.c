@@ -4,7 +4,18 @@
 #include "pagetable.h"
 
 // The top-level page table (also known as the 'page directory')
-pgdir_entry_t pgdir[PTRS_PER_PGDIR];
+pgdir_entry_t *pgdir;
+
+// Page table memory: the second-level tables allocated, and per directory
+// entry the number of entries of its table that map a page, resident or on
+// swap.
+int pgtbl_count = 0;
+unsigned *pgtbl_live;
+
+// Geometry of the address space (see pagetable.h)
+unsigned page_shift = 12;
+unsigned addr_bits = 36;
+unsigned pgdir_shift;
 
 // Counters for various events.
 // Your code must increment these when the related events occur.
@@ -14,10 +25,231 @@ int ref_count = 0;
 int evict_clean_count = 0;
 int evict_dirty_count = 0;
 
+unsigned ref_weight = 1;
+int reclaim_count = 0;		// batched reclaims
+
+int type_hit_count[4];
+int type_miss_count[4];
+int type_evict_count[4];
+
+// Access type of the reference being faulted in, for choose_pool and the
+// coremap.
+static int fault_type;
+
 
 void print_pagetbl(pgtbl_entry_t *pgtbl);
 void print_pagedirectory();
 
+// Huge page counters, reported by main when huge pages are enabled.
+int thp_hit_count = 0;		// hits on a subpage of a huge page
+int thp_miss_count = 0;		// misses resolved by mapping a huge page
+int thp_promote_count = 0;
+int thp_demote_count = 0;
+int thp_evict_count = 0;
+int thp_untouched = 0;		// resident huge subpages never referenced
+int thp_untouched_peak = 0;
+int thp_untouched_evicted = 0;	// huge subpages evicted without a reference
+
+// Batched reclaim: while deferring, evict_page leaves the writes of dirty
+// pages to flush_swapout, which clusters them.
+static int deferring;
+static unsigned pending[MAX_RECLAIM_BATCH];
+static int npending;
+
+/*
+ * Writes the dirty pages evicted by a batched reclaim to swap in one
+ * cluster. Their frames are free but still hold the data.
+ */
+static void flush_swapout() {
+	int offsets[MAX_RECLAIM_BATCH];
+	int i;
+
+	for (i = 0; i < npending; i++) {
+		offsets[i] = coremap[pending[i]].pte->swap_off;
+	}
+	if (swap_pageout_cluster(pending, offsets, npending) != 0) {
+		perror("Swap Error.\n");
+		exit(1);
+	}
+	for (i = 0; i < npending; i++) {
+		coremap[pending[i]].pte->swap_off = offsets[i];
+	}
+	npending = 0;
+}
+
+/*
+ * Writes the page in frame to swap, if needed, and updates its pagetable
+ * entry to indicate that the virtual page is no longer in (simulated)
+ * physical memory. The frame is released.
+ */
+static void evict_page(int frame) {
+	// Pick out victim_page to swap
+	pgtbl_entry_t *victim_page = coremap[frame].pte;
+	int swap_offset = victim_page->swap_off;
+
+	// Extract swap_offset. A clean page's copy on swap is up to date, so
+	// batched reclaim doesn't write it again; a dirty one is written with
+	// the rest of the batch.
+	if (!deferring) {
+		swap_offset = swap_pageout(frame, victim_page->swap_off);
+	} else if (victim_page->frame & PG_DIRTY) {
+		// A huge page evicted whole may hold more dirty subpages than
+		// the list takes.
+		if (npending == MAX_RECLAIM_BATCH) {
+			flush_swapout();
+		}
+		pending[npending++] = frame;
+	}
+
+	// Check if victim_page dirty or not. Change state(?) if dirty. Increment counter.
+	if (victim_page->frame & PG_DIRTY){
+		victim_page->frame = (victim_page->frame | PG_ONSWAP);
+		evict_dirty_count++;
+		modelled_time += cost_writeback;
+	}
+	else{
+		evict_clean_count++;
+	}
+
+	// Perform the swap
+	if (swap_offset != -1 || deferring){	// Success (or not written yet)
+		victim_page->swap_off = swap_offset;
+	}
+	else{	// Error when swapping
+		perror("Swap Error.\n");
+		exit(1);
+	}
+
+	// Update dirty & validity information
+	victim_page->frame  = victim_page->frame & (~PG_VALID);
+	victim_page->frame  = victim_page->frame & (~PG_DIRTY);
+	victim_page->frame  = victim_page->frame & (~PG_HUGE);
+
+	type_evict_count[(int)coremap[frame].type]++;
+	coremap[frame].in_use = 0;
+	coremap[frame].tail = 0;
+	pools[coremap[frame].pool].nr_free++;
+	pools[coremap[frame].pool].evict_count++;
+}
+
+/*
+ * Turns the huge page whose head entry is head back into HPAGE_NR base
+ * pages. Subpages that were never referenced stop counting as huge page
+ * fragmentation; they are now ordinary (cold) base pages.
+ */
+static void demote_huge(pgtbl_entry_t *head) {
+	int i;
+	for (i = 0; i < HPAGE_NR; i++) {
+		int frame = head[i].frame >> FRAME_SHIFT;
+		if (!coremap[frame].touched) {
+			thp_untouched--;
+		}
+		coremap[frame].tail = 0;
+		head[i].frame &= ~PG_HUGE;
+	}
+	thp_demote_count++;
+}
+
+/*
+ * Calls the replacement algorithm's evict_fcn to select a victim frame in
+ * pool and evicts the page it holds. If the victim is a huge page, it is
+ * either split or evicted as a whole according to thp_demote.
+ * Returns the victim frame, which is now free.
+ */
+static int reclaim_frame(struct pool *pool) {
+	int i;
+	int frame;
+
+	cur_pool = pool;
+	frame = evict_fcn();
+	pgtbl_entry_t *victim_page = coremap[frame].pte;
+
+	if (victim_page->frame & PG_HUGE) {
+		// The algorithm only sees head subpages, so victim_page is the
+		// first entry of the huge page.
+		if (thp_demote == THP_DEMOTE_EVICT) {
+			for (i = 0; i < HPAGE_NR; i++) {
+				int sub = victim_page[i].frame >> FRAME_SHIFT;
+				if (!coremap[sub].touched) {
+					thp_untouched--;
+					thp_untouched_evicted++;
+				}
+				evict_page(sub);
+			}
+			thp_evict_count++;
+			return frame;
+		}
+		demote_huge(victim_page);
+	}
+	evict_page(frame);
+	return frame;
+}
+
+/*
+ * Batched reclaim (-b): evicts pages of pool until at least want and at
+ * most reclaim_batch frames of it are free (or all of them, in a smaller
+ * pool), then writes the dirty ones out together. Returns one of the freed
+ * frames.
+ */
+static int reclaim_batch_frames(struct pool *pool, unsigned want) {
+	int frame = -1;
+
+	if (want < reclaim_batch) {
+		want = reclaim_batch;
+	}
+	if (want > pool->nframes) {
+		want = pool->nframes;
+	}
+
+	deferring = 1;
+	while (pool->nr_free < want) {
+		frame = reclaim_frame(pool);
+	}
+	flush_swapout();
+	deferring = 0;
+	reclaim_count++;
+	return frame;
+}
+
+/*
+ * Returns the pool a new frame for the virtual page at vaddr should come
+ * from, according to numa_policy. If the chosen pool is full but another one
+ * has free frames, the allocation falls back to that pool rather than
+ * evicting a page. In split mode the pool is chosen by access type and
+ * never falls back.
+ */
+static struct pool *choose_pool(addr_t vaddr) {
+	int node, i;
+
+	if (npools == 1) {
+		return &pools[0];
+	}
+	if (split_iframes != 0) {
+		return &pools[fault_type == REF_TYPE_CODE('I') ? POOL_INSTR : POOL_DATA];
+	}
+	switch (numa_policy) {
+	case NUMA_INTERLEAVE:
+		node = (vaddr >> PAGE_SHIFT) % npools;
+		break;
+	case NUMA_PREFERRED:
+		node = numa_preferred_node;
+		break;
+	default:
+		node = numa_cpu_node;
+		break;
+	}
+	if (pools[node].nr_free == 0) {
+		for (i = 1; i < npools; i++) {
+			struct pool *other = &pools[(node + i) % npools];
+			if (other->nr_free > 0) {
+				other->fallback_count++;
+				return other;
+			}
+		}
+	}
+	return &pools[node];
+}
+
 /*
  * Allocates a frame to be used for the virtual page represented by p.
  * If all frames are in use, calls the replacement algorithm's evict_fcn to
@@ -27,54 +259,33 @@ void print_pagedirectory();
  *
  * Counters for evictions should be updated appropriately in this function.
  */
-int allocate_frame(pgtbl_entry_t *p) {
+int allocate_frame(pgtbl_entry_t *p, addr_t vaddr) {
 	int i;
 	int frame = -1;
-	for(i = 0; i < memsize; i++) {
-		if(!coremap[i].in_use) {
-			frame = i;
-			break;
+	struct pool *pool = choose_pool(vaddr);
+
+	if (pool->nr_free > 0) {
+		for(i = pool->first; i < pool->first + pool->nframes; i++) {
+			if(!coremap[i].in_use) {
+				frame = i;
+				break;
+			}
 		}
 	}
 	if(frame == -1) { // Didn't find a free page.
-		// Call replacement algorithm's evict function to select victim
-		frame = evict_fcn();
-
 		// All frames were in use, so victim frame must hold some page
 		// Write victim page to swap, if needed, and update pagetable
-
-		// Pick out victim_page to swap
-		pgtbl_entry_t *victim_page = coremap[frame].pte;
-
-		// Extract swap_offset
-		int swap_offset = swap_pageout(frame, victim_page->swap_off);
-
-		// Check if victim_page dirty or not. Change state(?) if dirty. Increment counter.
-		if (victim_page->frame & PG_DIRTY){
-			victim_page->frame = (victim_page->frame | PG_ONSWAP);
-			evict_dirty_count++;
-		}
-		else{
-			evict_clean_count++;
-		}
-
-		// Perform the swap
-		if (swap_offset != -1){	// Success
-			victim_page->swap_off = swap_offset;
-		}
-		else{	// Error when swapping
-			perror("Swap Error.\n");
-			exit(1);
-		}
-
-		// Update dirty & validity information
-		victim_page->frame  = victim_page->frame & (~PG_VALID);
-		victim_page->frame  = victim_page->frame & (~PG_DIRTY);
+		frame = batch_reclaim ? reclaim_batch_frames(pool, 1) : reclaim_frame(pool);
 	}
 
 	// Record information for virtual page that will now be stored in frame
 	coremap[frame].in_use = 1;
 	coremap[frame].pte = p;
+	coremap[frame].tail = 0;
+	coremap[frame].touched = 1;
+	coremap[frame].type = fault_type;
+	pool->nr_free--;
+	pool->alloc_count++;
 
 	return frame;
 }
@@ -90,11 +301,16 @@ int allocate_frame(pgtbl_entry_t *p) {
  * need to be allocated and initialized as part of process creation.
  */
 void init_pagetable() {
-	int i;
 	// Set all entries in top-level pagetable to 0, which ensures valid
 	// bits are all 0 initially.
-	for (i=0; i < PTRS_PER_PGDIR; i++) {
-		pgdir[i].pde = 0;
+	free(pgdir);
+	free(pgtbl_live);
+	pgdir = calloc(PTRS_PER_PGDIR, sizeof(pgdir_entry_t));
+	pgtbl_live = calloc(PTRS_PER_PGDIR, sizeof(unsigned));
+	pgtbl_count = 0;
+	if (pgdir == NULL || pgtbl_live == NULL) {
+		perror("Failed to allocate page directory");
+		exit(1);
 	}
 }
 
@@ -106,7 +322,7 @@ pgdir_entry_t init_second_level() {
 
 	// Allocating aligned memory ensures the low bits in the pointer must
 	// be zero, so we can use them to store our status bits, like PG_VALID
-	if (posix_memalign((void **)&pgtbl, PAGE_SIZE,
+	if (posix_memalign((void **)&pgtbl, PGTBL_ALIGN,
 			   PTRS_PER_PGTBL*sizeof(pgtbl_entry_t)) != 0) {
 		perror("Failed to allocate aligned memory for page table");
 		exit(1);
@@ -130,7 +346,7 @@ pgdir_entry_t init_second_level() {
  * we fill the frame with zero's to prevent leaking information across
  * pages.
  *
- * In our simulation, we also store the the virtual address itself in the
+ * In our simulation, we also store the the virtual address of the page in the
  * page frame to help with error checking.
  *
  */
@@ -141,11 +357,116 @@ void init_frame(int frame, addr_t vaddr) {
         addr_t *vaddr_ptr = (addr_t *)(mem_ptr + sizeof(int));
 
 	memset(mem_ptr, 0, SIMPAGESIZE); // zero-fill the frame
-	*vaddr_ptr = vaddr;             // record the vaddr for error checking
+	*vaddr_ptr = vaddr & PAGE_MASK; // record the vaddr for error checking
 
 	return;
 }
 
+/*
+ * Fills frame with the content of the virtual page represented by p: read
+ * from swap if the page is on swap, otherwise freshly initialized.
+ */
+static void fill_frame(pgtbl_entry_t *p, int frame, addr_t vaddr) {
+	coremap[frame].address = vaddr & PAGE_MASK; // .adress for OPT
+
+	if (p->frame & PG_ONSWAP){	// p is SWAP
+		int pagein_result = swap_pagein(frame, p->swap_off);
+		// Error checking
+		if (pagein_result != 0){
+			perror("Error in swap_pagein.\n");
+			exit(1);
+		}
+		// Update information
+		p->frame = frame << FRAME_SHIFT;
+		p->frame = p->frame | PG_ONSWAP;
+		p->frame = p->frame & (~PG_DIRTY);
+		modelled_time += cost_major;
+
+	}
+	else{	// p is not swap
+		init_frame(frame, vaddr);
+		pgtbl_live[PGDIR_INDEX(vaddr)]++;	// maps a page from now on
+		p->frame = frame << FRAME_SHIFT;
+		p->frame = p->frame | PG_ONSWAP;
+		p->frame = p->frame | PG_DIRTY;
+		modelled_time += cost_minor;
+	}
+	p->frame = p->frame | PG_VALID;
+}
+
+/*
+ * Maps the 2 MiB region starting at the entry head (virtual address vaddr)
+ * as a huge page. Subpages that are not resident are filled; resident ones
+ * keep their frames. The head subpage is the only one the replacement
+ * algorithm sees from now on.
+ */
+static void promote_huge(pgtbl_entry_t *head, addr_t vaddr) {
+	int i, missing;
+
+	// Huge pages are only simulated with a single memory node.
+	struct pool *pool = &pools[0];
+
+	// Make room for all missing subpages before filling any of them, so
+	// reclaim can not pick a subpage we just brought in. Reclaim may evict
+	// a resident subpage of this region, so recount after each eviction.
+	while (1) {
+		missing = 0;
+		for (i = 0; i < HPAGE_NR; i++) {
+			if (!(head[i].frame & PG_VALID)) {
+				missing++;
+			}
+		}
+		if (pool->nr_free >= missing) {
+			break;
+		}
+		if (batch_reclaim) {
+			reclaim_batch_frames(pool, missing);
+		} else {
+			reclaim_frame(pool);
+		}
+	}
+
+	for (i = 0; i < HPAGE_NR; i++) {
+		int frame;
+		if (!(head[i].frame & PG_VALID)) {
+			addr_t sub_vaddr = vaddr + ((addr_t)i << PAGE_SHIFT);
+			frame = allocate_frame(&head[i], sub_vaddr);
+			fill_frame(&head[i], frame, sub_vaddr);
+			coremap[frame].touched = 0;
+		}
+		frame = head[i].frame >> FRAME_SHIFT;
+		if (!coremap[frame].touched) {
+			thp_untouched++;
+		}
+		coremap[frame].tail = (i != 0);
+		head[i].frame |= PG_HUGE;
+	}
+	if (thp_untouched > thp_untouched_peak) {
+		thp_untouched_peak = thp_untouched;
+	}
+	thp_promote_count++;
+}
+
+/*
+ * Returns true if the region of base pages containing the invalid entry p
+ * (at index snd_idx) should be mapped as a huge page when p is faulted in.
+ */
+static int should_promote(pgtbl_entry_t *p, unsigned snd_idx) {
+	pgtbl_entry_t *head;
+	int i, resident = 1; // p itself is about to become resident
+
+	if (thp_threshold == 0 || memsize < HPAGE_NR) {
+		return 0;
+	}
+	head = p - (snd_idx & HPAGE_INDEX_MASK);
+	for (i = 0; i < HPAGE_NR && resident < thp_threshold; i++) {
+		if (head[i].frame & PG_VALID) {
+			resident++;
+		}
+	}
+	return resident >= thp_threshold;
+}
+
 /*
  * Locate the physical frame number for the given vaddr using the page table.
  *
@@ -156,53 +477,62 @@ void init_frame(int frame, addr_t vaddr) {
  * If the entry is invalid and on swap, then a (simulated) physical frame
  * should be allocated and filled by reading the page data from swap.
  *
+ * With huge pages enabled, faulting in a page may map its whole 2 MiB
+ * region as a huge page instead (see should_promote).
+ *
  * Counters for hit, miss and reference events should be incremented in
  * this function.
+ *
+ * This is the body of find_physpage for pages of 2^pshift bytes and a page
+ * directory index above bit dshift. find_physpage is one of the copies
+ * below, each specialised for a common geometry with the shifts as
+ * constants, or the generic copy reading them from the globals, so the
+ * choice of geometry costs nothing per reference.
  */
-char *find_physpage(addr_t vaddr, char type) {
+static inline __attribute__((always_inline))
+char *walk(addr_t vaddr, char type, unsigned pshift, unsigned dshift) {
 	pgtbl_entry_t *p=NULL; // pointer to the full page table entry for vaddr
-	unsigned idx = PGDIR_INDEX(vaddr); // get index into page directory
+	unsigned idx = vaddr >> dshift; // get index into page directory
+	// HPAGE_INDEX_MASK; pages of 2 MiB or more are never huge
+	unsigned hmask = pshift < HPAGE_SHIFT ? (1U << (HPAGE_SHIFT - pshift)) - 1 : 0;
 
 	// Use top-level page directory to get pointer to 2nd-level page table
 	pgdir_entry_t dir_entry = pgdir[idx];
 	if ((dir_entry.pde & PG_VALID) == 0){	// init second level page table if not initialized
 		pgdir[idx] = init_second_level();
+		pgtbl_count++;
         dir_entry = pgdir[idx];
 	}
 
 	// Use vaddr to get index into 2nd-level page table and initialize 'p'
-	unsigned snd_idx = PGTBL_INDEX(vaddr);
+	unsigned snd_idx = (vaddr >> pshift) & ((1U << (dshift - pshift)) - 1);
 
-    pgtbl_entry_t* pagetable = (pgtbl_entry_t *)(dir_entry.pde & PAGE_MASK);
+    pgtbl_entry_t* pagetable = (pgtbl_entry_t *)(dir_entry.pde & PDE_MASK);
 	p = pagetable + snd_idx;
 
 	// Check if p is valid or not, on swap or not, and handle appropriately
 	if (p->frame & PG_VALID){
 		hit_count++;
+		type_hit_count[REF_TYPE_CODE(type)]++;
+		if (p->frame & PG_HUGE) {
+			thp_hit_count++;
+		}
 	}
 	else{	
+		double fault_start = modelled_time;
 		miss_count++;
-		int frame_number = allocate_frame(p);
-		coremap[frame_number].address = vaddr;		// .adress for OPT
-
-		if (p->frame & PG_ONSWAP){	// p is SWAP
-			int pagein_result = swap_pagein(frame_number, p->swap_off);
-			// Error checking
-			if (pagein_result != 0){
-				perror("Error in swap_pagein.\n");
-				exit(1);
-			}
-			// Update information
-			p->frame = frame_number << PAGE_SHIFT;
-			p->frame = p->frame | PG_ONSWAP;
-			p->frame = p->frame & (~PG_DIRTY);
-
+		type_miss_count[REF_TYPE_CODE(type)]++;
+		fault_type = REF_TYPE_CODE(type);
+		if (should_promote(p, snd_idx)) {
+			promote_huge(p - (snd_idx & hmask),
+				     vaddr & ~(HPAGE_SIZE - 1));
+			thp_miss_count++;
+		} else {
+			int frame_number = allocate_frame(p, vaddr);
+			fill_frame(p, frame_number, vaddr);
 		}
-		else{	// p is not swap
-			init_frame(frame_number, vaddr);
-			p->frame = frame_number << PAGE_SHIFT;
-			p->frame = p->frame | PG_ONSWAP;
-			p->frame = p->frame | PG_DIRTY;
+		if (cost_enabled) {
+			cost_record_fault(modelled_time - fault_start);
 		}
 	}
 
@@ -217,15 +547,243 @@ char *find_physpage(addr_t vaddr, char type) {
 			p->frame = p->frame | PG_DIRTY;
 	}
  
-	// Call replacement algorithm's ref_fcn for this page
-	ref_fcn(p);
+	// Call replacement algorithm's ref_fcn for this page. A huge page is
+	// referenced through its head subpage.
+	if (p->frame & PG_HUGE) {
+		struct frame *f = &coremap[p->frame >> FRAME_SHIFT];
+		if (!f->touched) {
+			f->touched = 1;
+			thp_untouched--;
+		}
+		ref_fcn(p - (snd_idx & hmask));
+	} else {
+		ref_fcn(p);
+	}
+
+	// Charge the access to the node holding the page.
+	if (npools > 1 && split_iframes == 0) {
+		int node = coremap[p->frame >> FRAME_SHIFT].pool;
+		if (node == numa_cpu_node) {
+			pools[node].local_count++;
+			modelled_time += numa_local_cost[node];
+		} else {
+			pools[node].remote_count++;
+			modelled_time += numa_remote_cost[node];
+		}
+	} else {
+		modelled_time += cost_hit;
+	}
+	if (cost_window != 0 && ref_count % cost_window == 0) {
+		cost_window_end();
+	}
+	if (aging_enabled && ref_count % aging_tick == 0) {
+		aging_sweep();
+	}
 
 	// Return pointer into (simulated) physical memory at start of frame
-	unsigned offset = (p->frame >> PAGE_SHIFT)*SIMPAGESIZE;
+	unsigned offset = (p->frame >> FRAME_SHIFT)*SIMPAGESIZE;
 	return  &physmem[offset];
 
 }
 
+#define WALK_VARIANT(bits, pshift) \
+	static char *find_physpage_##bits##_##pshift(addr_t vaddr, char type) { \
+		return walk(vaddr, type, pshift, pshift + (bits - pshift) / 2); \
+	}
+
+WALK_VARIANT(36, 12)
+WALK_VARIANT(36, 13)
+WALK_VARIANT(36, 14)
+WALK_VARIANT(36, 16)
+WALK_VARIANT(32, 12)
+WALK_VARIANT(32, 13)
+WALK_VARIANT(32, 14)
+WALK_VARIANT(32, 16)
+
+static char *find_physpage_any(addr_t vaddr, char type) {
+	return walk(vaddr, type, page_shift, pgdir_shift);
+}
+
+static const struct {
+	unsigned addr_bits;
+	unsigned page_shift;
+	char *(*fcn)(addr_t, char);
+} walk_variants[] = {
+	{36, 12, find_physpage_36_12}, {36, 13, find_physpage_36_13},
+	{36, 14, find_physpage_36_14}, {36, 16, find_physpage_36_16},
+	{32, 12, find_physpage_32_12}, {32, 13, find_physpage_32_13},
+	{32, 14, find_physpage_32_14}, {32, 16, find_physpage_32_16},
+};
+
+char *(*find_physpage)(addr_t vaddr, char type) = find_physpage_any;
+
+/*
+ * Derives the layout of the page tables from page_shift and addr_bits and
+ * picks the copy of find_physpage for it. Called once, after the options
+ * (or the snapshot being resumed) have set them.
+ */
+void init_geometry() {
+	unsigned i;
+
+	pgdir_shift = page_shift + (addr_bits - page_shift) / 2;
+	find_physpage = find_physpage_any;
+	for (i = 0; i < sizeof(walk_variants) / sizeof(walk_variants[0]); i++) {
+		if (walk_variants[i].addr_bits == addr_bits &&
+		    walk_variants[i].page_shift == page_shift) {
+			find_physpage = walk_variants[i].fcn;
+		}
+	}
+}
+
+/*
+ * Applies n more references to the page holding vaddr right after
+ * find_physpage returned it. The page is still resident, so they are all
+ * hits: counters, costs and cost windows come out as after n calls to
+ * find_physpage, but ref_fcn is called once for the lot. That leaves the
+ * algorithms that only look at the order of references in the same state;
+ * those that count references (lfu) take ref_weight into account.
+ */
+void repeat_hit(addr_t vaddr, char type, int write, unsigned n) {
+	pgtbl_entry_t *p = (pgtbl_entry_t *)(pgdir[PGDIR_INDEX(vaddr)].pde & PDE_MASK)
+		+ PGTBL_INDEX(vaddr);
+	pgtbl_entry_t *head = (p->frame & PG_HUGE) ?
+		p - (PGTBL_INDEX(vaddr) & HPAGE_INDEX_MASK) : p;
+	int node = coremap[p->frame >> FRAME_SHIFT].pool;
+	double cost = cost_hit;
+	unsigned step, total = n;
+
+	if (n == 0) {
+		return;
+	}
+	p->frame |= PG_REF;
+	if (write) {
+		p->frame |= PG_DIRTY;
+	}
+	hit_count += n;
+	type_hit_count[REF_TYPE_CODE(type)] += n;
+	if (p->frame & PG_HUGE) {
+		thp_hit_count += n;
+	}
+	if (npools > 1 && split_iframes == 0) {
+		cost = (node == numa_cpu_node) ? numa_local_cost[node]
+					       : numa_remote_cost[node];
+	}
+
+	// Stop at each cost window boundary and aging tick on the way.
+	while (n > 0) {
+		step = n;
+		if (cost_window != 0 && step > cost_window - ref_count % cost_window) {
+			step = cost_window - ref_count % cost_window;
+		}
+		if (aging_enabled && step > aging_tick - ref_count % aging_tick) {
+			step = aging_tick - ref_count % aging_tick;
+		}
+		ref_count += step;
+		if (npools > 1 && split_iframes == 0) {
+			if (node == numa_cpu_node) {
+				pools[node].local_count += step;
+			} else {
+				pools[node].remote_count += step;
+			}
+		}
+		modelled_time += step * cost;
+		if (cost_window != 0 && ref_count % cost_window == 0) {
+			cost_window_end();
+		}
+		n -= step;
+		// The page was referenced in each tick the run goes past; the
+		// tick it ends on is left until after ref_fcn, as in walk.
+		if (aging_enabled && ref_count % aging_tick == 0 && n > 0) {
+			head->frame |= PG_REF;
+			aging_sweep();
+		}
+	}
+
+	ref_weight = total;
+	ref_fcn(head);
+	ref_weight = 1;
+	if (aging_enabled && ref_count % aging_tick == 0) {
+		aging_sweep();
+	}
+}
+
+/*
+ * Writes the second-level page tables in use to a snapshot: the number of
+ * tables, then for each its index in the page directory and its entries.
+ */
+void pagetable_save(FILE *fp) {
+	int i, ntables = 0;
+
+	for (i = 0; i < PTRS_PER_PGDIR; i++) {
+		if (pgdir[i].pde & PG_VALID) {
+			ntables++;
+		}
+	}
+	snap_write(fp, &ntables, sizeof(int));
+	for (i = 0; i < PTRS_PER_PGDIR; i++) {
+		if (pgdir[i].pde & PG_VALID) {
+			snap_write(fp, &i, sizeof(int));
+			snap_write(fp, (pgtbl_entry_t *)(pgdir[i].pde & PDE_MASK),
+				   PTRS_PER_PGTBL * sizeof(pgtbl_entry_t));
+		}
+	}
+}
+
+/*
+ * Reads the page tables written by pagetable_save. The coremap has been
+ * restored already; the pte pointers it holds are stale, so each frame is
+ * pointed at the valid entry that maps it.
+ */
+void pagetable_load(FILE *fp) {
+	int i, j, idx, ntables;
+	pgtbl_entry_t *pgtbl;
+
+	snap_read(fp, &ntables, sizeof(int));
+	for (i = 0; i < ntables; i++) {
+		snap_read(fp, &idx, sizeof(int));
+		if (idx < 0 || idx >= PTRS_PER_PGDIR) {
+			fprintf(stderr, "Error: snapshot has an invalid page directory index\n");
+			exit(1);
+		}
+		pgdir[idx] = init_second_level();
+		pgtbl_count++;
+		pgtbl = (pgtbl_entry_t *)(pgdir[idx].pde & PDE_MASK);
+		snap_read(fp, pgtbl, PTRS_PER_PGTBL * sizeof(pgtbl_entry_t));
+		for (j = 0; j < PTRS_PER_PGTBL; j++) {
+			if (pgtbl[j].frame & PG_VALID) {
+				coremap[pgtbl[j].frame >> FRAME_SHIFT].pte = &pgtbl[j];
+			}
+			if (pgtbl[j].frame & (PG_VALID | PG_ONSWAP)) {
+				pgtbl_live[idx]++;
+			}
+		}
+	}
+}
+
+/*
+ * Prints the memory taken by the page tables, and how much of it maps
+ * pages: entries in use, and page table bytes per page in use.
+ */
+void print_pgtbl_stats() {
+	unsigned long i, live = 0;
+	unsigned long entries = (unsigned long)pgtbl_count * PTRS_PER_PGTBL;
+	unsigned long bytes = entries * sizeof(pgtbl_entry_t) +
+		PTRS_PER_PGDIR * sizeof(pgdir_entry_t);
+
+	for (i = 0; i < PTRS_PER_PGDIR; i++) {
+		live += pgtbl_live[i];
+	}
+	printf("\n");
+	printf("Page tables: %d (%lu KiB)\n", pgtbl_count,
+	       entries * sizeof(pgtbl_entry_t) / 1024);
+	printf("Page directory: %lu KiB\n",
+	       PTRS_PER_PGDIR * sizeof(pgdir_entry_t) / 1024);
+	printf("Page table entries in use: %lu of %lu (%.2f%%)\n", live, entries,
+	       entries ? (double)live / entries * 100 : 0.0);
+	printf("Page table bytes per page in use: %.1f\n",
+	       live ? (double)bytes / live : 0.0);
+}
+
 void print_pagetbl(pgtbl_entry_t *pgtbl) {
 	int i;
 	int first_invalid, last_invalid;
@@ -247,10 +805,13 @@ void print_pagetbl(pgtbl_entry_t *pgtbl) {
 			printf("\t[%d]: ",i);
 			if (pgtbl[i].frame & PG_VALID) {
 				printf("VALID, ");
+				if (pgtbl[i].frame & PG_HUGE) {
+					printf("HUGE, ");
+				}
 				if (pgtbl[i].frame & PG_DIRTY) {
 					printf("DIRTY, ");
 				}
-				printf("in frame %d\n",pgtbl[i].frame >> PAGE_SHIFT);
+				printf("in frame %d\n",pgtbl[i].frame >> FRAME_SHIFT);
 			} else {
 				assert(pgtbl[i].frame & PG_ONSWAP);
 				printf("ONSWAP, at offset %lu\n",pgtbl[i].swap_off);
@@ -282,7 +843,7 @@ void print_pagedirectory() {
 				       first_invalid, last_invalid);
 				first_invalid = last_invalid = -1;
 			}
-			pgtbl = (pgtbl_entry_t *)(pgdir[i].pde & PAGE_MASK);
+			pgtbl = (pgtbl_entry_t *)(pgdir[i].pde & PDE_MASK);
 			printf("[%d]: %p\n",i, pgtbl);
 			print_pagetbl(pgtbl);
 		}
@@ -5,36 +5,48 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-#define TRACE_64
-
-#define PAGE_SHIFT      12     // number of bits 2^(PAGE_SHIFT) == PAGE_SIZE
-#define PAGE_SIZE       4096 // Size of pagetable pages
+// The page size and the width of the trace's addresses are chosen at
+// startup (-g and -x, see init_geometry), so the macros below read globals.
+// User-level virtual addresses are 36 bits in traces from 64-bit Linux and
+// 32 bits in traces from 32-bit Linux. The bits above the page offset are
+// split evenly into the top-level (page directory) index and the
+// second-level (page table) index, the page table getting the smaller half
+// if they don't split evenly. With 4096-byte pages that is 12 bits each for
+// 64-bit traces and 10 bits each for 32-bit traces.
+extern unsigned page_shift;	// number of bits 2^(page_shift) == page size
+extern unsigned addr_bits;	// width of the trace's addresses
+extern unsigned pgdir_shift;	// leaves just the page directory index
+
+#define PAGE_SHIFT      page_shift
+#define PAGE_SIZE       (1UL << PAGE_SHIFT)
 #define PAGE_MASK       (~(PAGE_SIZE-1))
+#define PGDIR_SHIFT     pgdir_shift
+#define PTRS_PER_PGDIR  (1U << (addr_bits - PGDIR_SHIFT))
+#define PTRS_PER_PGTBL  (1U << (PGDIR_SHIFT - PAGE_SHIFT))
+
+#define MIN_PAGE_SHIFT  10
+#define MAX_PAGE_SHIFT  24
+
+// A page table entry holds the frame number above its status bits, and a
+// page directory entry the address of a page table aligned to
+// PGTBL_ALIGN; neither depends on the simulated page size.
+#define FRAME_SHIFT     12
+#define PGTBL_ALIGN     4096
+#define PDE_MASK        (~(uintptr_t)(PGTBL_ALIGN-1))
 #define PG_VALID        (0x1) // Valid bit in pgd or pte, set if in memory
 #define PG_DIRTY        (0x2) // Dirty bit in pgd or pte, set if modified
 #define PG_REF          (0x4) // Reference bit, set if page has been referenced
 #define PG_ONSWAP       (0x8) // Set if page has been evicted to swap
+#define PG_HUGE         (0x10) // Set if page is a subpage of a huge page
 #define INVALID_SWAP    -1
 
-#ifdef TRACE_64
-// User-level virtual addresses on 64-bit Linux system are 36 bits in our traces
-// and the page size is still 4096 (12 bits).
-// We split the remaining 24 bits evenly into top-level (page directory) index
-// and second-level (page table) index, using 12 bits for each.
-#define PGDIR_SHIFT         24     // Leaves just top 12 bits of vaddr
-#define PTRS_PER_PGDIR    4096
-#define PTRS_PER_PGTBL    4096
-
-#else // TRACE_32
-// User-level virtual addresses on 32-bit Linux system are 32 bits, and the
-// page size is still 4096 (12 bits).
-// We split the remaining 20 bits evenly into top-level (page directory) index
-// and second level (page table) index, using 10 bits for each.
-#define PGDIR_SHIFT       22     // Leaves just top 10 bits of vaddr
-#define PTRS_PER_PGDIR  1024
-#define PTRS_PER_PGTBL  1024
-
-#endif
+// Huge pages are 2 MiB. A second-level table covers more than that, so a
+// huge page is mapped by an aligned run of HPAGE_NR entries in one table,
+// all marked PG_HUGE. The first entry of the run is the head of the huge page.
+#define HPAGE_SHIFT       21     // number of bits 2^(HPAGE_SHIFT) == HPAGE_SIZE
+#define HPAGE_SIZE        (1UL << HPAGE_SHIFT)
+#define HPAGE_NR          (1 << (HPAGE_SHIFT - PAGE_SHIFT)) // base pages per huge page
+#define HPAGE_INDEX_MASK  (HPAGE_NR-1)
 
 #define PGTBL_MASK        (PTRS_PER_PGTBL-1)
 #define PGDIR_INDEX(x)   ((x) >> PGDIR_SHIFT)
@@ -56,10 +68,16 @@ typedef struct {
 	off_t swap_off;       // offset in swap file of vpage, if any
 } pgtbl_entry_t;
 
+extern void init_geometry(void);
 extern void init_pagetable();
-extern char *find_physpage(addr_t vaddr, char type);
+// Specialised for the geometry by init_geometry
+extern char *(*find_physpage)(addr_t vaddr, char type);
 
 extern void print_pagedirectory(void);
+extern void print_pgtbl_stats(void);
+
+extern int pgtbl_count;
+extern unsigned *pgtbl_live;
 
 struct frame {
 	char in_use;       // True if frame is allocated, False if frame is free
@@ -70,8 +88,48 @@ struct frame {
 	int referenced;		// Reference bit for CLOCK
 	addr_t address;		// Address for OPT, init in pagetable.c
 
+	char tail;		// True if frame holds a non-head subpage of a huge page
+	char touched;		// True if page was referenced since it was filled
+	unsigned char pool;	// Index of the pool (memory node) holding frame
+	char type;		// REF_TYPE_CODE of the reference that faulted
+				// the page in
+	int pins;		// Threads accessing the frame right now; a pinned
+				// frame is not evicted (multi-threaded mode)
 };
 
+struct functions;
+
+/* Physical memory is split into one or more pools of contiguous frames,
+ * one per simulated memory node. Each pool has its own free frames and runs
+ * its own instance of the replacement algorithm: evict_fcn must choose a
+ * victim in cur_pool, and init_fcn is called once per pool.
+ */
+struct pool {
+	unsigned first;		// First frame (index into coremap) of the pool
+	unsigned nframes;	// Number of frames in the pool
+	unsigned nr_free;	// Number of frames not in use
+	int hand;		// Position of the algorithm's sweep (fifo, clock)
+
+	int local_count;	// References from the cpu's own node
+	int remote_count;	// References from another node
+	int alloc_count;	// Frames allocated in this pool
+	int fallback_count;	// Allocations placed here because the
+				// preferred pool was full
+	int evict_count;	// Pages evicted from this pool
+
+	struct functions *alg;	// Replacement algorithm of the pool (split mode)
+};
+
+extern struct pool *pools;
+extern int npools;
+extern struct pool *cur_pool;
+
+/* True if the replacement algorithm may choose frame f as a victim.
+ * Free frames and the tail subpages of a huge page are skipped; a huge page
+ * is represented to the algorithm by its head subpage only.
+ */
+#define FRAME_EVICTABLE(f)	(coremap[f].in_use && !coremap[f].tail)
+
 /* The coremap holds information about physical memory.
  * The index into coremap is the physical page frame number stored
  * in the page table entry (pgtbl_entry_t).
@@ -90,6 +148,9 @@ extern void lru_init();
 extern void clock_init();
 extern void fifo_init();
 extern void opt_init();
+extern void lfu_init();
+extern void aging_init();
+extern void optw_init();
 
 // These may not need to do anything for some algorithms
 extern void rand_ref(pgtbl_entry_t *);
@@ -97,11 +158,29 @@ extern void lru_ref(pgtbl_entry_t *);
 extern void clock_ref(pgtbl_entry_t *);
 extern void fifo_ref(pgtbl_entry_t *);
 extern void opt_ref(pgtbl_entry_t *);
+extern void lfu_ref(pgtbl_entry_t *);
+extern void aging_ref(pgtbl_entry_t *);
+extern void optw_ref(pgtbl_entry_t *);
 
 extern int rand_evict();
 extern int lru_evict();
 extern int clock_evict();
 extern int fifo_evict();
 extern int opt_evict();
+extern int lfu_evict();
+extern int aging_evict();
+extern int optw_evict();
+
+extern void lru_save(FILE *);
+extern void rand_save(FILE *);
+extern void lfu_save(FILE *);
+extern void aging_save(FILE *);
+
+extern void lru_load(FILE *);
+extern void rand_load(FILE *);
+extern void opt_load(FILE *);
+extern void lfu_load(FILE *);
+extern void aging_load(FILE *);
+extern void optw_load(FILE *);
 
 #endif /* PAGETABLE_H */
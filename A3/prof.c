@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "sim.h"
+#include "pagetable.h"
+
+//---------------------------------------------------------------------
+// Profiling (-p). The simulation is split into components: the page table
+// walk and fault handling in find_physpage, the replacement algorithm
+// (ref_fcn and evict_fcn), swap I/O, and everything else (replay). The
+// time stamp counter and, where the kernel allows it, a group of hardware
+// counters are read at every switch from one component to another, and
+// the difference is charged to the component that was running. Components
+// nest (find_physpage calls evict_fcn, which is followed by a swap write),
+// so each one is charged only for its own work.
+//
+// Reading the counters is a system call, so profiling slows the simulation
+// down a lot, and some of that overhead is charged to the components.
+
+#define PROF_COUNTERS 4
+
+static const char *prof_names[PROF_COMPONENTS] = {
+	"other", "walk", "policy", "swap"
+};
+static const char *counter_names[PROF_COUNTERS] = {
+	"cycles", "instructions", "cache misses", "branch misses"
+};
+static const uint64_t counter_configs[PROF_COUNTERS] = {
+	PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+int profiling = 0;
+
+struct prof_component {
+	long calls;
+	uint64_t ticks;			// time stamp counter
+	uint64_t counts[PROF_COUNTERS];	// hardware counters
+};
+
+static struct prof_component components[PROF_COMPONENTS];
+static int stack[16];		// components being run, innermost last
+static int depth;
+static uint64_t last_ticks, last_counts[PROF_COUNTERS];
+static int perf_fd = -1;	// group leader, -1 if counters are unavailable
+static int kernel_counted;	// counters include time in the kernel
+
+static void (*real_ref)(pgtbl_entry_t *);
+static int (*real_evict)();
+
+static inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static void read_counts(uint64_t *counts) {
+	struct {
+		uint64_t nr;
+		uint64_t values[PROF_COUNTERS];
+	} group;
+
+	if (perf_fd == -1) {
+		return;
+	}
+	if (read(perf_fd, &group, sizeof(group)) != sizeof(group)) {
+		perror("Failed to read hardware counters");
+		exit(1);
+	}
+	memcpy(counts, group.values, sizeof(group.values));
+}
+
+/* Opens the group of hardware counters, counting in the kernel too if
+ * allowed (the swap I/O is mostly system calls). Returns the group leader
+ * or -1.
+ */
+static int open_counters(int exclude_kernel) {
+	struct perf_event_attr attr;
+	int i, fd, leader = -1;
+
+	for (i = 0; i < PROF_COUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = counter_configs[i];
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.disabled = (i == 0);
+		attr.exclude_kernel = exclude_kernel;
+		attr.exclude_hv = 1;
+		fd = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+		if (fd == -1) {
+			if (leader != -1) {
+				close(leader);	// closes the whole group
+			}
+			return -1;
+		}
+		if (i == 0) {
+			leader = fd;
+		}
+	}
+	return leader;
+}
+
+/* Charges what was counted since the last switch to the running component. */
+static inline void charge() {
+	uint64_t now = ticks(), counts[PROF_COUNTERS];
+	struct prof_component *c = &components[stack[depth - 1]];
+	int i;
+
+	read_counts(counts);
+	c->ticks += now - last_ticks;
+	last_ticks = now;
+	if (perf_fd != -1) {
+		for (i = 0; i < PROF_COUNTERS; i++) {
+			c->counts[i] += counts[i] - last_counts[i];
+			last_counts[i] = counts[i];
+		}
+	}
+}
+
+void prof_enter(int component) {
+	if (depth == 0) {
+		return;		// stopped
+	}
+	charge();
+	stack[depth++] = component;
+	components[component].calls++;
+}
+
+void prof_exit(int component) {
+	if (depth == 0) {
+		return;
+	}
+	charge();
+	depth--;
+}
+
+static void prof_ref(pgtbl_entry_t *p) {
+	prof_enter(PROF_POLICY);
+	real_ref(p);
+	prof_exit(PROF_POLICY);
+}
+
+static int prof_evict() {
+	int frame;
+	prof_enter(PROF_POLICY);
+	frame = real_evict();
+	prof_exit(PROF_POLICY);
+	return frame;
+}
+
+/*
+ * Starts profiling the simulation: wraps the replacement algorithm's
+ * functions, opens the hardware counters and starts charging "other".
+ */
+void prof_start() {
+	real_ref = ref_fcn;
+	real_evict = evict_fcn;
+	ref_fcn = prof_ref;
+	evict_fcn = prof_evict;
+
+	kernel_counted = 1;
+	if ((perf_fd = open_counters(0)) == -1) {
+		kernel_counted = 0;
+		perf_fd = open_counters(1);
+	}
+	if (perf_fd == -1) {
+		fprintf(stderr, "Hardware counters unavailable, profiling with "
+			"the time stamp counter only\n");
+	} else {
+		ioctl(perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+
+	memset(components, 0, sizeof(components));
+	depth = 0;
+	stack[depth++] = PROF_OTHER;
+	components[PROF_OTHER].calls = 1;
+	read_counts(last_counts);
+	last_ticks = ticks();
+}
+
+/* Stops profiling at the end of the replay. */
+void prof_stop() {
+	charge();
+	if (perf_fd != -1) {
+		ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	}
+	ref_fcn = real_ref;
+	evict_fcn = real_evict;
+	depth = 0;
+}
+
+/* Prints what each component cost, and its share of the total. */
+void print_prof_stats() {
+	int i, j;
+	uint64_t total = 0;
+
+	for (i = 0; i < PROF_COMPONENTS; i++) {
+		total += components[i].ticks;
+	}
+
+	printf("\n");
+	printf("Profile (%s):\n", perf_fd == -1 ? "time stamp counter only" :
+	       kernel_counted ? "user and kernel" : "user only");
+	for (i = 0; i < PROF_COMPONENTS; i++) {
+		struct prof_component *c = &components[i];
+		printf("%s: %ld calls, %llu ticks (%.2f%%)", prof_names[i], c->calls,
+		       (unsigned long long)c->ticks,
+		       total ? (double)c->ticks / total * 100 : 0.0);
+		if (perf_fd != -1) {
+			for (j = 0; j < PROF_COUNTERS; j++) {
+				printf(", %llu %s", (unsigned long long)c->counts[j],
+				       counter_names[j]);
+			}
+			printf(", IPC %.2f", c->counts[0] ?
+			       (double)c->counts[1] / c->counts[0] : 0.0);
+		}
+		printf("\n");
+	}
+}
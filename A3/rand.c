@@ -16,7 +16,10 @@ extern struct frame *coremap;
  */
 int rand_evict() {
 	// choose index in coremap to evict a page from
-	int idx = (int)(random() % memsize);
+	int idx;
+	do {
+		idx = cur_pool->first + (int)(random() % cur_pool->nframes);
+	} while (!FRAME_EVICTABLE(idx));
 	
 	return idx;
 }
@@ -30,5 +33,20 @@ void rand_ref(pgtbl_entry_t *p) {
 	return;
 }
 
+// State of random(), kept here so that it can be saved in a snapshot.
+// Seeding it with 1 gives the same sequence as an unseeded random().
+static char rand_state[128];
+
 void rand_init() {
+	initstate(1, rand_state, sizeof(rand_state));
+}
+
+void rand_save(FILE *fp) {
+	setstate(rand_state);	// records the current position in rand_state
+	snap_write(fp, rand_state, sizeof(rand_state));
+}
+
+void rand_load(FILE *fp) {
+	snap_read(fp, rand_state, sizeof(rand_state));
+	setstate(rand_state);
 }
@@ -4,32 +4,64 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 #include "sim.h"
 #include "pagetable.h"
 
 // Define global variables declared in sim.h
 unsigned memsize = 0;
+unsigned swapsize = 4096;
 int debug = 0;
 char *physmem = NULL;
+unsigned simpagesize = MIN_SIMPAGESIZE;
 struct frame *coremap = NULL;
 char *tracefile = NULL;
+int thp_threshold = 0;
+int thp_demote = THP_DEMOTE_SPLIT;
+
+struct pool *pools = NULL;
+int npools = 1;
+struct pool *cur_pool = NULL;
+int numa_policy = NUMA_FIRST_TOUCH;
+int numa_cpu_node = 0;
+int numa_preferred_node = 0;
+double numa_local_cost[MAX_NODES];
+double numa_remote_cost[MAX_NODES];
+int type_stats = 0;
+unsigned split_iframes = 0;
+char *split_ialg = NULL;
 
 /* The algs array gives us a mapping between the name of an eviction
  * algorithm as given in a command line argument, and the function to
  * call to select the victim page.
  */
 struct functions algs[] = {
-	{"rand", rand_init, rand_ref, rand_evict},
-	{"lru", lru_init, lru_ref, lru_evict},
+	{"rand", rand_init, rand_ref, rand_evict, rand_save, rand_load},
+	{"lru", lru_init, lru_ref, lru_evict, lru_save, lru_load},
 	{"fifo", fifo_init, fifo_ref, fifo_evict},
 	{"clock",clock_init, clock_ref, clock_evict},
-	{"opt", opt_init, opt_ref, opt_evict}
+	{"opt", opt_init, opt_ref, opt_evict, NULL, opt_load},
+	{"lfu", lfu_init, lfu_ref, lfu_evict, lfu_save, lfu_load},
+	{"aging", aging_init, aging_ref, aging_evict, aging_save, aging_load},
+	{"optw", optw_init, optw_ref, optw_evict, NULL, optw_load}
 };
-int num_algs = 5;
+int num_algs = 8;
 
+char *alg_name = NULL;
 void (*init_fcn)() = NULL;
 void (*ref_fcn)(pgtbl_entry_t *) = NULL;
 int (*evict_fcn)() = NULL;
+void (*save_fcn)(FILE *) = NULL;
+void (*load_fcn)(FILE *) = NULL;
+
+// Snapshot options.
+char *snapshot_file = NULL;	// where to write snapshots
+char *resume_file = NULL;	// snapshot to resume from
+unsigned checkpoint_interval = 0; // references between snapshots
+unsigned stop_after = 0;	// stop once this many references are replayed
+volatile sig_atomic_t interrupted = 0;
 
 
 /* An actual memory access based on the vaddr from the trace file.
@@ -47,11 +79,13 @@ int (*evict_fcn)() = NULL;
  * counter.
  */
 void access_mem(char type, addr_t vaddr) {
+	PROF_BEGIN(PROF_WALK);
 	char *memptr = find_physpage(vaddr, type);
+	PROF_END(PROF_WALK);
 	int *versionptr = (int *)memptr;
 	addr_t *checkaddr = (addr_t *)(memptr + sizeof(int));
 
-	if (*checkaddr != vaddr) {
+	if (*checkaddr != (vaddr & PAGE_MASK)) {
 		fprintf(stderr,"Error, simulated page returned by pagetable lookup doese not have expected value.\n");
 	}
 	if (type == 'S' || type == 'M') {
@@ -61,38 +95,439 @@ void access_mem(char type, addr_t vaddr) {
 }
 
 
-void replay_trace(FILE *infp) {
-	char buf[MAXLINE];
-	addr_t vaddr = 0;
-	char type;
+/* Splits the memsize frames of physical memory into npools pools of
+ * (nearly) equal size, or in split mode into the instruction and data
+ * pools.
+ */
+void init_pools() {
+	int i;
+	unsigned f, first = 0;
 
-	//int counter = 0;
-	while(fgets(buf, MAXLINE, infp) != NULL) {
-		if(buf[0] != '=') {
-			sscanf(buf, "%c %lx", &type, &vaddr);
-			/*if(debug)  {
-				printf("%d: %c %lx\n", counter++, type, vaddr);
-			}*/
-			access_mem(type, vaddr);
+	pools = calloc(npools, sizeof(struct pool));
+	for (i = 0; i < npools; i++) {
+		pools[i].first = first;
+		if (split_iframes != 0) {
+			pools[i].nframes = (i == POOL_INSTR) ? split_iframes
+							     : memsize - split_iframes;
 		} else {
+			pools[i].nframes = memsize / npools + (i < memsize % npools);
+		}
+		pools[i].nr_free = pools[i].nframes;
+		for (f = first; f < first + pools[i].nframes; f++) {
+			coremap[f].pool = i;
+		}
+		first += pools[i].nframes;
+	}
+}
+
+/* Parses a list of "local:remote" access costs, one per node. The last
+ * pair given applies to the remaining nodes.
+ */
+void parse_numa_costs(char *arg) {
+	int i = 0;
+	double local = 100, remote = 160;
+	char *tok;
+
+	for (tok = strtok(arg, ","); tok != NULL && i < MAX_NODES;
+	     tok = strtok(NULL, ",")) {
+		if (sscanf(tok, "%lf:%lf", &local, &remote) != 2) {
+			fprintf(stderr, "Error: invalid node cost %s, expected local:remote\n",
+				tok);
+			exit(1);
+		}
+		numa_local_cost[i] = local;
+		numa_remote_cost[i] = remote;
+		i++;
+	}
+	for (; i < MAX_NODES; i++) {
+		numa_local_cost[i] = local;
+		numa_remote_cost[i] = remote;
+	}
+}
+
+/* Prints per node access and eviction statistics and the effective access
+ * time of the simulated cpu.
+ */
+void print_numa_stats() {
+	int i;
+	long local = 0, remote = 0;
+	double cost = 0;
+
+	printf("\n");
+	for (i = 0; i < npools; i++) {
+		struct pool *pool = &pools[i];
+		printf("Node %d: %u frames, %d local, %d remote, %d allocations "
+		       "(%d fallback), %d evictions\n",
+		       i, pool->nframes, pool->local_count, pool->remote_count,
+		       pool->alloc_count, pool->fallback_count, pool->evict_count);
+		local += pool->local_count;
+		remote += pool->remote_count;
+		cost += pool->local_count * numa_local_cost[i] +
+			pool->remote_count * numa_remote_cost[i];
+	}
+	printf("Local accesses: %.4f\n", (double)local/ref_count * 100);
+	printf("Remote accesses: %.4f\n", (double)remote/ref_count * 100);
+	printf("Memory access time: %.2f\n", cost/ref_count);
+}
+
+/* Take a snapshot and stop at the next reference boundary. */
+void handle_interrupt(int sig) {
+	interrupted = 1;
+}
+
+/* Takes the snapshots due after the references before trace index next.
+ * Returns nonzero once the replay should stop.
+ */
+static int end_of_step(size_t next) {
+	if (snapshot_file != NULL &&
+	    (interrupted || (checkpoint_interval != 0 &&
+			     ref_count % checkpoint_interval == 0))) {
+		snapshot_save(snapshot_file, next);
+		if (interrupted) {
+			fprintf(stderr, "Interrupted, snapshot saved to %s\n",
+				snapshot_file);
+			swap_destroy();
+			exit(1);
+		}
+	}
+	if (stop_after != 0 && ref_count >= stop_after) {
+		if (snapshot_file != NULL) {
+			snapshot_save(snapshot_file, next);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/* Replays the loaded trace from reference first on. */
+void replay_trace(size_t first) {
+	size_t i;
+
+	for (i = first; i < trace.nrefs; i++) {
+		ref_t ref = trace.refs[i];
+		access_mem(REF_TYPE(ref), REF_ADDR(ref));
+		if (end_of_step(i + 1)) {
+			break;
+		}
+	}
+}
+
+/* Replays the streamed trace (-z), skipping the first references when
+ * resuming.
+ */
+void replay_stream(size_t first) {
+	size_t i = 0;
+	ref_t ref;
+
+	trace_open(tracefile, optw_window);
+	while (trace_next(&ref)) {
+		if (i++ < first) {
 			continue;
 		}
+		access_mem(REF_TYPE(ref), REF_ADDR(ref));
+		if (end_of_step(i)) {
+			break;
+		}
+	}
+	trace_close();
+}
+
+static size_t run_count;	// runs replayed with -R
+
+/* Replays the loaded trace from reference first on as runs of references
+ * to the same page. The first reference of a run goes through access_mem;
+ * the rest can only hit and are applied in one step by repeat_hit, split
+ * only where a snapshot is due. The page's version counter is incremented
+ * once per run, by the first reference if it writes.
+ */
+void replay_runs(size_t first) {
+	struct runs runs;
+	size_t i, next = first;
+	unsigned left, n;
+	int done = 0;
+
+	trace_runs(&trace, first, &runs);
+	for (i = 0; i < runs.nruns && !done; i++) {
+		struct run *r = &runs.runs[i];
+
+		access_mem(r->type, r->vaddr);
+		next++;
+		left = r->count - 1;
+		while (!(done = end_of_step(next)) && left > 0) {
+			n = left;
+			if (snapshot_file != NULL && checkpoint_interval != 0 &&
+			    n > checkpoint_interval - ref_count % checkpoint_interval) {
+				n = checkpoint_interval - ref_count % checkpoint_interval;
+			}
+			if (stop_after != 0 && n > stop_after - ref_count) {
+				n = stop_after - ref_count;
+			}
+			repeat_hit(r->vaddr, r->type, r->write, n);
+			left -= n;
+			next += n;
+		}
+	}
+	run_count = i;
+	free(runs.runs);
+}
+
+/* Prints hits, misses and evictions by access type and, in split mode, the
+ * use of the instruction and data pools.
+ */
+void print_type_stats() {
+	int i;
+
+	printf("\n");
+	for (i = 0; i < 4; i++) {
+		int refs = type_hit_count[i] + type_miss_count[i];
+		printf("%c: %d references, %d hits, %d misses, %d evictions, "
+		       "hit rate %.4f\n", "ILSM"[i], refs, type_hit_count[i],
+		       type_miss_count[i], type_evict_count[i],
+		       refs ? (double)type_hit_count[i]/refs * 100 : 0.0);
+	}
+	if (split_iframes != 0) {
+		for (i = 0; i < npools; i++) {
+			printf("%s memory: %u frames, %s, %d allocations, %d evictions\n",
+			       i == POOL_INSTR ? "Instruction" : "Data",
+			       pools[i].nframes, pools[i].alg->name,
+			       pools[i].alloc_count, pools[i].evict_count);
+		}
+	}
+}
+
+void print_stats() {
+	printf("\n");
+	printf("Hit count: %d\n", hit_count);
+	printf("Miss count: %d\n", miss_count);
+	printf("Clean evictions: %d\n",evict_clean_count);
+	printf("Dirty evictions: %d\n",evict_dirty_count);
+	printf("Total references : %d\n", ref_count);
+	printf("Hit rate: %.4f\n", (double)hit_count/ref_count * 100);
+	printf("Miss rate: %.4f\n", (double)miss_count/ref_count *100);
+
+	print_pgtbl_stats();
+
+	if (npools > 1 && split_iframes == 0) {
+		print_numa_stats();
+	}
+
+	if (type_stats || split_iframes != 0) {
+		print_type_stats();
+	}
+
+	if (profiling) {
+		print_prof_stats();
+	}
+
+	if (run_length) {
+		printf("\n");
+		printf("Runs replayed: %zu\n", run_count);
+	}
+
+	if (batch_reclaim) {
+		printf("\n");
+		printf("Reclaim batches: %d\n", reclaim_count);
+		printf("Swap writes: %d (%d pages)\n", swap_write_ops, swap_pages_written);
+		printf("Swap reads: %d\n", swap_read_ops);
+	}
+
+	if (cost_enabled) {
+		print_cost_stats();
+	}
+
+	if (thp_threshold != 0) {
+		printf("\n");
+		printf("Huge page hits: %d\n", thp_hit_count);
+		printf("Huge page misses: %d\n", thp_miss_count);
+		printf("Base page hits: %d\n", hit_count - thp_hit_count);
+		printf("Base page misses: %d\n", miss_count - thp_miss_count);
+		printf("Huge page promotions: %d\n", thp_promote_count);
+		printf("Huge page demotions: %d\n", thp_demote_count);
+		printf("Huge page evictions: %d\n", thp_evict_count);
+		// Internal fragmentation: subpages brought in with a huge page
+		// that were never referenced.
+		printf("Untouched huge subpages at exit: %d (%lu KiB)\n",
+		       thp_untouched, (unsigned long)thp_untouched * PAGE_SIZE / 1024);
+		printf("Untouched huge subpages peak: %d (%lu KiB)\n",
+		       thp_untouched_peak,
+		       (unsigned long)thp_untouched_peak * PAGE_SIZE / 1024);
+		printf("Untouched huge subpages evicted: %d\n", thp_untouched_evicted);
+	}
+}
+
+/* Returns the entry of algs for the algorithm named alg.
+ */
+struct functions *find_alg(char *alg) {
+	int i;
+	for (i = 0; i < num_algs; i++) {
+		if(strcmp(algs[i].name, alg) == 0) {
+			return &algs[i];
+		}
+	}
+	fprintf(stderr, "Error: invalid replacement algorithm - %s\n",
+			alg);
+	exit(1);
+}
 
+/* In split mode each pool runs its own algorithm; these pass each call on
+ * to the algorithm of the pool concerned.
+ */
+static void split_init() {
+	cur_pool->alg->init();
+}
+
+static void split_ref(pgtbl_entry_t *p) {
+	pools[coremap[p->frame >> FRAME_SHIFT].pool].alg->ref(p);
+}
+
+static int split_evict() {
+	return cur_pool->alg->evict();
+}
+
+/* Initializes the replacement algorithm functions for the algorithm
+ * named alg. In split mode alg is the algorithm of the data pool.
+ */
+void select_alg(char *alg) {
+	struct functions *f = find_alg(alg);
+
+	alg_name = f->name;
+	aging_enabled = 0;	// set by aging_init or aging_load
+	init_fcn = f->init;
+	ref_fcn = f->ref;
+	evict_fcn = f->evict;
+	save_fcn = f->save;
+	load_fcn = f->load;
+
+	if (split_iframes != 0) {
+		pools[POOL_INSTR].alg = split_ialg ? find_alg(split_ialg) : f;
+		pools[POOL_DATA].alg = f;
+		init_fcn = split_init;
+		ref_fcn = split_ref;
+		evict_fcn = split_evict;
 	}
-	/*if (debug){
-		printf("%d exit while loop.", counter);
-	}*/
 }
 
+/* Sets up the memory and the replacement algorithm named alg, from the
+ * snapshot in resume_file if there is one. Returns the index in the trace
+ * of the first reference to replay.
+ */
+size_t start_simulation(char *alg) {
+	int i, same_alg = 0;
+	size_t first = 0;
+
+	// Initialize main data structures for simulation.
+	// This happens before calling the replacement algorithm init function
+	// so that the init_fcn can refer to the coremap if needed.
+	coremap = calloc(memsize, sizeof(struct frame));
+	physmem = malloc(memsize * SIMPAGESIZE);
+	init_pools();
+	swap_init(swapsize);
+	init_pagetable();
+
+	// Initialize replacement algorithm functions.
+	select_alg(alg);
+
+	if (resume_file != NULL) {
+		first = snapshot_restore(resume_file, &same_alg);
+	}
+	// Call replacement algorithm's init_fcn for each pool before replaying
+	// trace. A snapshot taken with the same algorithm restores its state
+	// instead; another algorithm starts cold on the warm memory.
+	if (!same_alg) {
+		for (i = 0; i < npools; i++) {
+			cur_pool = &pools[i];
+			init_fcn();
+		}
+	}
+	return first;
+}
+
+/* Replays the trace with the replacement algorithm named alg, starting
+ * from the snapshot in resume_file if there is one, and prints the results.
+ */
+void simulate(char *alg) {
+	size_t first = start_simulation(alg);
+
+	if (profiling) {
+		prof_start();
+	}
+	if (trace_stream) {
+		replay_stream(first);
+	} else if (run_length) {
+		replay_runs(first);
+	} else {
+		replay_trace(first);
+	}
+	if (profiling) {
+		prof_stop();
+	}
+	print_pagedirectory();
+
+	// Cleanup - removes temporary swapfile.
+	swap_destroy();
+
+	print_stats();
+}
+
+/* One simulation of a (possibly multi-algorithm) run, and its results for
+ * the summary. optw is simulated once for each window given.
+ */
+struct sim_run {
+	char *alg;
+	unsigned window;
+	int misses;
+	int refs;
+};
+
+/* Prints the misses of each optw window next to those of opt, if it ran,
+ * to show how close a bounded lookahead gets.
+ */
+static void print_optw_summary(struct sim_run *runs, int nruns) {
+	int i, opt_misses = -1;
+
+	for (i = 0; i < nruns; i++) {
+		if (strcmp(runs[i].alg, "opt") == 0) {
+			opt_misses = runs[i].misses;
+		}
+	}
+	printf("=== optw summary ===\n");
+	if (opt_misses >= 0) {
+		printf("opt: %d misses\n", opt_misses);
+	}
+	for (i = 0; i < nruns; i++) {
+		if (strcmp(runs[i].alg, "optw") != 0) {
+			continue;
+		}
+		printf("optw W=%u: %d misses, miss rate %.4f", runs[i].window,
+		       runs[i].misses, (double)runs[i].misses/runs[i].refs * 100);
+		if (opt_misses > 0) {
+			printf(", %.2f%% more than opt",
+			       (double)(runs[i].misses - opt_misses)/opt_misses * 100);
+		}
+		printf("\n");
+	}
+}
 
 int main(int argc, char *argv[]) {
-	int opt;
-	unsigned swapsize = 4096;
-	FILE *tfp = stdin;
+	int opt, nalgs = 0, nwindows = 0, nruns = 0, any_optw = 0;
+	int belady_frames = 0, diverge_log = 0;
 	char *replacement_alg = NULL;
-	char *usage = "USAGE: sim -f tracefile -m memorysize -s swapsize -a algorithm\n";
+	char *alg_list[16];
+	unsigned windows[16];
+	struct sim_run *runs;
+	char *tok, *thp_arg = NULL;
+	unsigned long size;
+	char *usage = "USAGE: sim -f tracefile -m memorysize -s swapsize -a algorithm[,algorithm...] "
+		"[-H never|always|full|n] [-D split|evict] [-N nodes] "
+		"[-P first-touch|interleave|preferred=node] [-c cpunode] "
+		"[-C local:remote,...] [-L hit=ns,minor=ns,major=ns,writeback=ns] "
+		"[-w window] [-S snapshot [-k interval] [-e refs]] [-r snapshot] "
+		"[-T threads] [-b batch] [-j loaderthreads] [-R] [-t] "
+		"[-i iframes[:algorithm]] [-A agingtick] [-z] [-W window[,window...]] [-p] "
+		"[-g pagesize] [-x 32|64] [-F framesize] [-K frames | -V count]\n";
 
-	while ((opt = getopt(argc, argv, "f:m:a:s:")) != -1) {
+	parse_numa_costs(strdup("100:160"));
+	while ((opt = getopt(argc, argv, "f:m:a:s:H:D:N:P:c:C:L:w:S:k:e:r:T:b:j:Rti:A:zW:pg:x:F:K:V:")) != -1) {
 		switch (opt) {
 		case 'f':
 			tracefile = optarg;
@@ -106,63 +541,399 @@ int main(int argc, char *argv[]) {
 		case 's':
 			swapsize = (unsigned)strtoul(optarg, NULL, 10);
 			break;
+		case 'H':
+			// Parsed below, once the page size is known
+			thp_arg = optarg;
+			break;
+		case 'D':
+			if (strcmp(optarg, "split") == 0) {
+				thp_demote = THP_DEMOTE_SPLIT;
+			} else if (strcmp(optarg, "evict") == 0) {
+				thp_demote = THP_DEMOTE_EVICT;
+			} else {
+				fprintf(stderr, "%s", usage);
+				exit(1);
+			}
+			break;
+		case 'N':
+			npools = (int)strtol(optarg, NULL, 10);
+			if (npools < 1 || npools > MAX_NODES) {
+				fprintf(stderr, "Error: number of nodes must be between 1 and %d\n",
+					MAX_NODES);
+				exit(1);
+			}
+			break;
+		case 'P':
+			if (strcmp(optarg, "first-touch") == 0) {
+				numa_policy = NUMA_FIRST_TOUCH;
+			} else if (strcmp(optarg, "interleave") == 0) {
+				numa_policy = NUMA_INTERLEAVE;
+			} else if (strncmp(optarg, "preferred=", 10) == 0) {
+				numa_policy = NUMA_PREFERRED;
+				numa_preferred_node = (int)strtol(optarg + 10, NULL, 10);
+			} else {
+				fprintf(stderr, "%s", usage);
+				exit(1);
+			}
+			break;
+		case 'c':
+			numa_cpu_node = (int)strtol(optarg, NULL, 10);
+			break;
+		case 'C':
+			parse_numa_costs(optarg);
+			break;
+		case 'L':
+			parse_costs(optarg);
+			break;
+		case 'w':
+			cost_window = (unsigned)strtoul(optarg, NULL, 10);
+			cost_enabled = 1;
+			break;
+		case 'S':
+			snapshot_file = optarg;
+			break;
+		case 'k':
+			checkpoint_interval = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		case 'e':
+			stop_after = (unsigned)strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			resume_file = optarg;
+			break;
+		case 'T':
+			mt_threads = (int)strtol(optarg, NULL, 10);
+			break;
+		case 'R':
+			run_length = 1;
+			break;
+		case 't':
+			type_stats = 1;
+			break;
+		case 'p':
+			profiling = 1;
+			break;
+		case 'z':
+			trace_stream = 1;
+			break;
+		case 'W':
+			for (tok = strtok(optarg, ","); tok != NULL && nwindows < 16;
+			     tok = strtok(NULL, ",")) {
+				windows[nwindows++] = (unsigned)strtoul(tok, NULL, 10);
+			}
+			break;
+		case 'A':
+			aging_tick = (unsigned)strtoul(optarg, NULL, 10);
+			if (aging_tick == 0) {
+				fprintf(stderr, "Error: aging tick must be at least one reference\n");
+				exit(1);
+			}
+			break;
+		case 'i':
+			split_iframes = (unsigned)strtoul(optarg, &split_ialg, 10);
+			split_ialg = (*split_ialg == ':') ? split_ialg + 1 : NULL;
+			if (split_iframes == 0) {
+				fprintf(stderr, "%s", usage);
+				exit(1);
+			}
+			break;
+		case 'j':
+			loader_threads = (int)strtol(optarg, NULL, 10);
+			break;
+		case 'b':
+			reclaim_batch = (int)strtol(optarg, NULL, 10);
+			batch_reclaim = 1;
+			if (reclaim_batch < 1 || reclaim_batch > 1024) {
+				fprintf(stderr, "Error: reclaim batch must be between 1 and 1024\n");
+				exit(1);
+			}
+			break;
+		case 'g':
+			size = strtoul(optarg, NULL, 10);
+			for (page_shift = MIN_PAGE_SHIFT;
+			     page_shift < MAX_PAGE_SHIFT && (1UL << page_shift) < size;
+			     page_shift++)
+				;
+			if ((1UL << page_shift) != size) {
+				fprintf(stderr, "Error: page size must be a power of two from %lu to %lu\n",
+					1UL << MIN_PAGE_SHIFT, 1UL << MAX_PAGE_SHIFT);
+				exit(1);
+			}
+			break;
+		case 'x':
+			// User addresses of 64-bit Linux fit in 36 bits
+			if (strcmp(optarg, "32") == 0) {
+				addr_bits = 32;
+			} else if (strcmp(optarg, "64") == 0) {
+				addr_bits = 36;
+			} else {
+				fprintf(stderr, "%s", usage);
+				exit(1);
+			}
+			break;
+		case 'F':
+			simpagesize = (unsigned)strtoul(optarg, NULL, 10);
+			if (simpagesize < MIN_SIMPAGESIZE) {
+				fprintf(stderr, "Error: frame size must be at least %d bytes\n",
+					MIN_SIMPAGESIZE);
+				exit(1);
+			}
+			break;
+		case 'K':
+			belady_frames = (int)strtol(optarg, NULL, 10);
+			if (belady_frames < 1) {
+				fprintf(stderr, "%s", usage);
+				exit(1);
+			}
+			break;
+		case 'V':
+			diverge_log = (int)strtol(optarg, NULL, 10);
+			if (diverge_log < 1) {
+				fprintf(stderr, "%s", usage);
+				exit(1);
+			}
+			break;
 		default:
 			fprintf(stderr, "%s", usage);
 			exit(1);
 		}
 	}
-	if(tracefile != NULL) {
-		if((tfp = fopen(tracefile, "r")) == NULL) {
-			perror("Error opening tracefile:");
+	if(thp_arg != NULL) {
+		// Number of resident subpages that triggers promotion
+		if (strcmp(thp_arg, "never") == 0) {
+			thp_threshold = 0;
+		} else if (page_shift >= HPAGE_SHIFT) {
+			fprintf(stderr, "Error: huge pages need a page size below %lu\n",
+				HPAGE_SIZE);
 			exit(1);
+		} else if (strcmp(thp_arg, "always") == 0) {
+			thp_threshold = 1;
+		} else if (strcmp(thp_arg, "full") == 0) {
+			thp_threshold = HPAGE_NR;
+		} else {
+			thp_threshold = (int)strtol(thp_arg, NULL, 10);
+			if (thp_threshold < 1 || thp_threshold > HPAGE_NR) {
+				fprintf(stderr, "Error: huge page threshold must be between 1 and %d\n",
+					HPAGE_NR);
+				exit(1);
+			}
 		}
 	}
-
-	// Initialize main data structures for simulation.
-	// This happens before calling the replacement algorithm init function
-	// so that the init_fcn can refer to the coremap if needed.
-	coremap = calloc(memsize, sizeof(struct frame));
-	physmem = malloc(memsize * SIMPAGESIZE);
-	swap_init(swapsize);
-	init_pagetable();
-
-	// Initialize replacement algorithm functions.
 	if(replacement_alg == NULL) {
 		fprintf(stderr, "%s", usage);
 		exit(1);
-	} else {
-		int i;
-		for (i = 0; i < num_algs; i++) {
-			if(strcmp(algs[i].name, replacement_alg) == 0) {
-				init_fcn = algs[i].init;
-				ref_fcn = algs[i].ref;
-				evict_fcn = algs[i].evict;
-				break;
+	}
+	for (alg_list[nalgs] = strtok(replacement_alg, ",");
+	     alg_list[nalgs] != NULL && nalgs < 15;
+	     alg_list[++nalgs] = strtok(NULL, ","))
+		;
+
+	// optw runs once per lookahead window.
+	if (nwindows == 0) {
+		windows[nwindows++] = optw_window;
+	}
+	runs = mmap(NULL, 16 * 16 * sizeof(struct sim_run), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (runs == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	for (int i = 0; i < nalgs; i++) {
+		int n = strcmp(alg_list[i], "optw") == 0 ? nwindows : 1;
+		for (int j = 0; j < n; j++) {
+			runs[nruns].alg = alg_list[i];
+			runs[nruns].window = windows[j];
+			nruns++;
+		}
+		any_optw |= (strcmp(alg_list[i], "optw") == 0);
+	}
+	optw_window = windows[0];
+
+	// The memory layout is the one the snapshot was taken with.
+	if(resume_file != NULL) {
+		snapshot_load_config(resume_file);
+	}
+	init_geometry();
+	if(split_iframes != 0) {
+		if (npools != 1 || thp_threshold != 0 || snapshot_file != NULL ||
+		    resume_file != NULL || mt_threads != 0) {
+			fprintf(stderr, "Error: split memory can't be combined with nodes, "
+				"huge pages, snapshots or threads\n");
+			exit(1);
+		}
+		if (split_iframes >= memsize) {
+			fprintf(stderr, "Error: the instruction pool must be smaller than memorysize\n");
+			exit(1);
+		}
+		if (split_ialg != NULL) {
+			find_alg(split_ialg);
+		}
+		npools = 2;
+	}
+	if(numa_cpu_node < 0 || numa_cpu_node >= npools ||
+	   numa_preferred_node < 0 || numa_preferred_node >= npools) {
+		fprintf(stderr, "Error: node number must be less than %d\n", npools);
+		exit(1);
+	}
+	if(memsize < npools) {
+		fprintf(stderr, "Error: memorysize must be at least one frame per node\n");
+		exit(1);
+	}
+	if(thp_threshold != 0 && npools > 1) {
+		fprintf(stderr, "Error: huge pages can only be simulated with one node\n");
+		exit(1);
+	}
+	if(thp_threshold != 0 && memsize < HPAGE_NR) {
+		fprintf(stderr, "Error: huge pages need a memorysize of at least %d frames\n",
+			HPAGE_NR);
+		exit(1);
+	}
+	if(snapshot_file != NULL) {
+		if (nruns > 1) {
+			fprintf(stderr, "Error: snapshots can only be taken with one algorithm\n");
+			exit(1);
+		}
+		signal(SIGINT, handle_interrupt);
+		signal(SIGTERM, handle_interrupt);
+	}
+
+	if(trace_stream) {
+		if (run_length || mt_threads != 0) {
+			fprintf(stderr, "Error: a streamed trace can't be replayed as runs "
+				"or by threads\n");
+			exit(1);
+		}
+		if (tracefile == NULL && nruns > 1) {
+			fprintf(stderr, "Error: standard input can only be streamed once, "
+				"use -f for several simulations\n");
+			exit(1);
+		}
+		for (int i = 0; i < nalgs; i++) {
+			if (strcmp(alg_list[i], "opt") == 0 ||
+			    (split_ialg != NULL && strcmp(split_ialg, "opt") == 0)) {
+				fprintf(stderr, "Error: opt needs the whole trace, use optw "
+					"to stream it\n");
+				exit(1);
+			}
+		}
+	}
+
+	if(mt_threads != 0) {
+		// Threads replay the traces named by -f, separated by commas.
+		if (tracefile == NULL || npools > 1 || thp_threshold != 0 ||
+		    cost_enabled || snapshot_file != NULL || resume_file != NULL ||
+		    run_length) {
+			fprintf(stderr, "Error: threads need a tracefile and can't be combined "
+				"with nodes, huge pages, costs, snapshots or runs\n");
+			exit(1);
+		}
+		for (int i = 0; i < nalgs; i++) {
+			if (strcmp(alg_list[i], "opt") == 0 ||
+			    strcmp(alg_list[i], "optw") == 0 ||
+			    strcmp(alg_list[i], "lfu") == 0 ||
+			    strcmp(alg_list[i], "aging") == 0) {
+				fprintf(stderr, "Error: %s can't be simulated with threads\n",
+					alg_list[i]);
+				exit(1);
 			}
 		}
-		if(evict_fcn == NULL) {
-			fprintf(stderr, "Error: invalid replacement algorithm - %s\n",
-					replacement_alg);
+		batch_reclaim = 0;	// the threads batch their own way
+		if (profiling) {
+			fprintf(stderr, "Error: threads can't be profiled\n");
+			exit(1);
+		}
+		if (mt_threads < 0 || memsize <= 2 * mt_threads) {
+			fprintf(stderr, "Error: memorysize must be more than twice the number of threads\n");
 			exit(1);
 		}
 	}
-	// Call replacement algorithm's init_fcn before replaying trace.
-	init_fcn();
 
-	replay_trace(tfp);
-	print_pagedirectory();
+	if(belady_frames != 0 || diverge_log != 0) {
+		if (belady_frames != 0 && diverge_log != 0) {
+			fprintf(stderr, "%s", usage);
+			exit(1);
+		}
+		if (trace_stream || run_length || mt_threads != 0 ||
+		    snapshot_file != NULL || resume_file != NULL || profiling) {
+			fprintf(stderr, "Error: lockstep comparisons need the whole trace and "
+				"can't be combined with runs, threads, snapshots or profiling\n");
+			exit(1);
+		}
+		if (diverge_log != 0 && nalgs != 2) {
+			fprintf(stderr, "Error: -V compares two algorithms\n");
+			exit(1);
+		}
+		for (int i = 0; i < nalgs; i++) {
+			find_alg(alg_list[i]);
+		}
+	}
 
-	// Cleanup - removes temporary swapfile.
-	swap_destroy();
+	// Load the trace once; forked simulations share it.
+	if (mt_threads == 0 && !trace_stream) {
+		trace_load(&trace, tracefile);
+	}
 
-	printf("\n");
-	printf("Hit count: %d\n", hit_count);
-	printf("Miss count: %d\n", miss_count);
-	printf("Clean evictions: %d\n",evict_clean_count);
-	printf("Dirty evictions: %d\n",evict_dirty_count);
-	printf("Total references : %d\n", ref_count);
-	printf("Hit rate: %.4f\n", (double)hit_count/ref_count * 100);
-	printf("Miss rate: %.4f\n", (double)miss_count/ref_count *100);
+	if (diverge_log != 0) {
+		printf("=== %s vs %s ===\n", alg_list[0], alg_list[1]);
+		fflush(stdout);
+		lockstep_diverge(alg_list[0], alg_list[1], diverge_log);
+		return(0);
+	}
+	if (belady_frames != 0) {
+		for (int i = 0; i < nalgs; i++) {
+			printf("=== %s, %u vs %u frames ===\n", alg_list[i], memsize,
+			       memsize + belady_frames);
+			fflush(stdout);
+			lockstep_belady(alg_list[i], belady_frames);
+		}
+		return(0);
+	}
+
+	if (nruns == 1) {
+		if (mt_threads != 0) {
+			mt_simulate(alg_list[0]);
+		} else {
+			simulate(alg_list[0]);
+		}
+		return(0);
+	}
+
+	// Each algorithm runs in its own process, one after the other, so all
+	// start from the same (possibly warm) state.
+	for (int i = 0; i < nruns; i++) {
+		pid_t pid;
+		int status;
+
+		if (strcmp(runs[i].alg, "optw") == 0) {
+			printf("=== optw W=%u ===\n", runs[i].window);
+		} else {
+			printf("=== %s ===\n", runs[i].alg);
+		}
+		fflush(stdout);
+		if ((pid = fork()) == -1) {
+			perror("fork");
+			exit(1);
+		}
+		if (pid == 0) {
+			optw_window = runs[i].window;
+			if (mt_threads != 0) {
+				mt_simulate(runs[i].alg);
+			} else {
+				simulate(runs[i].alg);
+			}
+			runs[i].misses = miss_count;
+			runs[i].refs = ref_count;
+			exit(0);
+		}
+		if (waitpid(pid, &status, 0) == -1 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "Error: simulation with %s failed\n", runs[i].alg);
+			exit(1);
+		}
+	}
+	if (any_optw) {
+		print_optw_summary(runs, nruns);
+	}
 
 	return(0);
 }
@@ -3,9 +3,13 @@
 
 #include "pagetable.h"
 #define MAXLINE 256
-#define SIMPAGESIZE 16  /* Simulated physical memory page frame size */
+#define SIMPAGESIZE simpagesize  /* Simulated physical memory page frame size */
+#define MIN_SIMPAGESIZE 16	/* version number and address, see access_mem */
+
+extern unsigned simpagesize;
 
 extern unsigned memsize;
+extern unsigned swapsize;
 extern int debug;
 
 extern int hit_count;
@@ -14,6 +18,75 @@ extern int ref_count;
 extern int evict_clean_count;
 extern int evict_dirty_count;
 
+/* Huge page (THP) simulation. A region is promoted to a huge page once
+ * thp_threshold of its HPAGE_NR subpages are resident (0 disables huge
+ * pages, 1 allocates huge pages at first touch). thp_demote selects what
+ * happens when the replacement algorithm picks a huge page as its victim.
+ */
+#define THP_DEMOTE_SPLIT 0 // split into base pages, evict only the victim
+#define THP_DEMOTE_EVICT 1 // evict every subpage of the huge page
+extern int thp_threshold;
+extern int thp_demote;
+
+extern int thp_hit_count;
+extern int thp_miss_count;
+extern int thp_promote_count;
+extern int thp_demote_count;
+extern int thp_evict_count;
+extern int thp_untouched;
+extern int thp_untouched_peak;
+extern int thp_untouched_evicted;
+
+/* NUMA simulation. Each memory node is a pool (see pagetable.h); a page is
+ * placed when it is faulted in according to numa_policy, relative to the
+ * node the simulated cpu runs on. A reference costs numa_local_cost[n] if
+ * node n is the cpu's node and numa_remote_cost[n] otherwise.
+ */
+#define MAX_NODES 64
+#define NUMA_FIRST_TOUCH 0 // the cpu's node
+#define NUMA_INTERLEAVE  1 // round-robin over nodes by virtual page number
+#define NUMA_PREFERRED   2 // numa_preferred_node
+extern int numa_policy;
+extern int numa_cpu_node;
+extern int numa_preferred_node;
+extern double numa_local_cost[MAX_NODES];
+extern double numa_remote_cost[MAX_NODES];
+
+/* Cost model. Each reference is charged cost_hit (or its node's cost on a
+ * NUMA run) and each miss the time to service the fault: cost_minor for a
+ * freshly initialized frame, cost_major for a read from swap, plus
+ * cost_writeback for each dirty page evicted to make room.
+ */
+extern int cost_enabled;
+extern double cost_hit;
+extern double cost_minor;
+extern double cost_major;
+extern double cost_writeback;
+extern unsigned cost_window;
+extern double modelled_time;
+extern void parse_costs(char *arg);
+extern void cost_record_fault(double latency);
+extern void cost_window_end(void);
+extern void print_cost_stats(void);
+
+/* Statistics by access type, indexed by REF_TYPE_CODE: hits and misses of
+ * references of each type, and evictions of pages faulted in by each type.
+ */
+extern int type_stats;		// print them (-t)
+extern int type_hit_count[4];
+extern int type_miss_count[4];
+extern int type_evict_count[4];
+
+/* Split mode. Memory is split into an instruction pool of split_iframes
+ * frames, which pages faulted in by an instruction fetch go to, and a data
+ * pool holding the rest; each has its own replacement algorithm.
+ * split_iframes is 0 unless split mode is on.
+ */
+#define POOL_INSTR 0
+#define POOL_DATA  1
+extern unsigned split_iframes;
+extern char *split_ialg;	// algorithm of the instruction pool
+
 /* We simulate physical memory with a large array of bytes */
 extern char *physmem;
 
@@ -23,17 +96,138 @@ extern char *physmem;
  */
 extern char *tracefile;
 
+/* A trace is loaded (trace.c) into an array of references, each packed
+ * in 64 bits: the address above the 2-bit access type.
+ */
+typedef uint64_t ref_t;
+#define REF_TYPE_CODE(type) ((type) == 'I' ? 0 : (type) == 'S' ? 2 : \
+			     (type) == 'M' ? 3 : 1)
+#define MAKE_REF(type, vaddr) (((ref_t)(vaddr) << 2) | REF_TYPE_CODE(type))
+#define REF_TYPE(r)	("ILSM"[(r) & 3])
+#define REF_ADDR(r)	((addr_t)((r) >> 2))
+
+struct trace {
+	ref_t *refs;
+	size_t nrefs;
+};
+
+/* The trace being replayed, which OPT reads ahead in */
+extern struct trace trace;
+extern int loader_threads;
+extern void trace_load(struct trace *t, char *path);
+
+/* A run of count consecutive references to the page of vaddr, the first
+ * of them of the given type; write is set if any of them writes.
+ */
+struct run {
+	addr_t vaddr;
+	unsigned count;
+	char type;
+	char write;
+};
+
+struct runs {
+	struct run *runs;
+	size_t nruns;
+};
+
+/* Instead of loading the whole trace, a simulation can stream it (-z),
+ * reading ahead only as far as optw looks.
+ */
+extern int trace_stream;
+extern void trace_open(char *path, size_t lookahead);
+extern int trace_next(ref_t *ref);
+extern void trace_close(void);
+extern int trace_ahead(size_t i, ref_t *ref);
+extern unsigned optw_window;	// references optw looks ahead (-W)
+
+extern int run_length;		// replay the trace as runs (-R)
+extern void trace_runs(struct trace *t, size_t first, struct runs *r);
+extern void repeat_hit(addr_t vaddr, char type, int write, unsigned n);
+extern unsigned ref_weight;	// references the current ref_fcn call
+				// stands for, for algorithms that count them
+
 // Each eviction algorithm is represented by a structure with its name
-// and three functions.
+// and three functions, plus two optional ones for algorithms that keep
+// state outside the coremap and the pools.
 struct functions {
 	char *name;                  // String name of eviction algorithm
 	void (*init)(void);          // Initialize any data needed by alg
 	void (*ref)(pgtbl_entry_t *);    // Called on each reference
 	int (*evict)();              // Called to choose victim for eviction
+	void (*save)(FILE *);        // Write alg state to a snapshot
+	void (*load)(FILE *);        // Restore alg state instead of init
 };
 
+/* References between two ticks of the aging algorithm (-A) */
+extern unsigned aging_tick;
+/* Set while aging manages a pool; aging_sweep is then due at every tick */
+extern int aging_enabled;
+extern void aging_sweep(void);
+
+extern char *alg_name;
 extern void (*init_fcn)();
 extern void (*ref_fcn)(pgtbl_entry_t *);
 extern int (*evict_fcn)();
+extern void (*save_fcn)(FILE *);
+extern void (*load_fcn)(FILE *);
+
+extern struct functions *find_alg(char *alg);
+extern void select_alg(char *alg);
+extern void init_pools(void);
+extern void print_stats(void);
+extern size_t start_simulation(char *alg);
+extern void access_mem(char type, addr_t vaddr);
+
+/* Lockstep comparisons (lockstep.c): one algorithm with more memory (-K),
+ * or two algorithms (-V)
+ */
+extern void lockstep_belady(char *alg, unsigned extra);
+extern void lockstep_diverge(char *alg1, char *alg2, int nlog);
+
+/* Multi-threaded simulation (mtsim.c) */
+extern int mt_threads;
+extern int reclaim_batch;	// frames reclaimed at once (-b), also without
+				// threads if batch_reclaim is set
+extern int batch_reclaim;
+extern int reclaim_count;
+#define MAX_RECLAIM_BATCH 1024
+
+/* Swap I/O (swap.c): write calls and the pages they wrote, read calls */
+extern int swap_write_ops;
+extern int swap_pages_written;
+extern int swap_read_ops;
+extern int swap_pageout_cluster(unsigned *frames, int *offsets, int n);
+extern void mt_simulate(char *alg);
+
+/* Profiling (prof.c, -p): the components the time and hardware counters
+ * are charged to. The time is charged to the innermost component entered.
+ */
+#define PROF_OTHER	0	// replay, statistics
+#define PROF_WALK	1	// find_physpage: page table walk, faults
+#define PROF_POLICY	2	// ref_fcn and evict_fcn
+#define PROF_SWAP	3	// swap reads and writes
+#define PROF_COMPONENTS	4
+extern int profiling;
+extern void prof_enter(int component);
+extern void prof_exit(int component);
+extern void prof_start(void);
+extern void prof_stop(void);
+extern void print_prof_stats(void);
+#define PROF_BEGIN(c)	do { if (profiling) prof_enter(c); } while (0)
+#define PROF_END(c)	do { if (profiling) prof_exit(c); } while (0)
+
+/* Snapshots (snapshot.c), and the parts of them written by other modules */
+extern void snap_write(FILE *fp, const void *buf, size_t size);
+extern void snap_read(FILE *fp, void *buf, size_t size);
+extern void snapshot_save(char *path, size_t trace_index);
+extern void snapshot_load_config(char *path);
+extern size_t snapshot_restore(char *path, int *same_alg);
+extern void pagetable_save(FILE *fp);
+extern void pagetable_load(FILE *fp);
+extern void swap_save(FILE *fp);
+extern void swap_load(FILE *fp);
+extern void cost_save(FILE *fp);
+extern void cost_load(FILE *fp);
 
 #endif // __SIM_H 
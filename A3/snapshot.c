@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "pagetable.h"
+
+//---------------------------------------------------------------------
+// Snapshots of the full simulation state, so a long run can be resumed
+// after an interruption and a warmed-up state can be replayed with several
+// replacement algorithms.
+//
+// A snapshot holds, in order: the header below, the counters, the pools,
+// the coremap, physmem, the page tables, the swap bitmap and contents, the
+// cost model samples and finally the replacement algorithm's own state.
+
+#define SNAP_MAGIC "A3SNAP05"
+
+struct snap_header {
+	char magic[8];
+	// Configuration restored when resuming.
+	unsigned simpagesize;
+	unsigned page_shift;
+	unsigned addr_bits;
+	unsigned memsize;
+	unsigned swapsize;
+	int npools;
+	int thp_threshold;
+	int thp_demote;
+	int numa_policy;
+	int numa_cpu_node;
+	int numa_preferred_node;
+	char alg[16];		// Algorithm the state was recorded with
+	size_t trace_index;	// Index of the next reference in the trace
+};
+
+static struct snap_header header;
+
+// Counters saved with the snapshot, so the final report covers the whole
+// trace.
+static int *counters[] = {
+	&hit_count, &miss_count, &ref_count,
+	&evict_clean_count, &evict_dirty_count,
+	&thp_hit_count, &thp_miss_count, &thp_promote_count,
+	&thp_demote_count, &thp_evict_count, &thp_untouched,
+	&thp_untouched_peak, &thp_untouched_evicted,
+	&type_hit_count[0], &type_hit_count[1], &type_hit_count[2],
+	&type_hit_count[3], &type_miss_count[0], &type_miss_count[1],
+	&type_miss_count[2], &type_miss_count[3], &type_evict_count[0],
+	&type_evict_count[1], &type_evict_count[2], &type_evict_count[3],
+	&reclaim_count, &swap_write_ops, &swap_pages_written, &swap_read_ops,
+};
+#define NCOUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+void snap_write(FILE *fp, const void *buf, size_t size) {
+	if (size != 0 && fwrite(buf, size, 1, fp) != 1) {
+		perror("Failed to write snapshot");
+		exit(1);
+	}
+}
+
+void snap_read(FILE *fp, void *buf, size_t size) {
+	if (size != 0 && fread(buf, size, 1, fp) != 1) {
+		fprintf(stderr, "Error: snapshot is truncated or unreadable\n");
+		exit(1);
+	}
+}
+
+/*
+ * Writes the current state to path. trace_index is the index in the
+ * trace of the next reference to replay. The snapshot is written to a
+ * temporary file first, so an interrupted write never replaces a good
+ * snapshot.
+ */
+void snapshot_save(char *path, size_t trace_index) {
+	unsigned i;
+	FILE *fp;
+	char *tmp = malloc(strlen(path) + 5);
+
+	sprintf(tmp, "%s.tmp", path);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		perror("Error creating snapshot");
+		exit(1);
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAP_MAGIC, sizeof(header.magic));
+	header.simpagesize = SIMPAGESIZE;
+	header.page_shift = PAGE_SHIFT;
+	header.addr_bits = addr_bits;
+	header.memsize = memsize;
+	header.swapsize = swapsize;
+	header.npools = npools;
+	header.thp_threshold = thp_threshold;
+	header.thp_demote = thp_demote;
+	header.numa_policy = numa_policy;
+	header.numa_cpu_node = numa_cpu_node;
+	header.numa_preferred_node = numa_preferred_node;
+	strncpy(header.alg, alg_name, sizeof(header.alg) - 1);
+	header.trace_index = trace_index;
+	snap_write(fp, &header, sizeof(header));
+
+	for (i = 0; i < NCOUNTERS; i++) {
+		snap_write(fp, counters[i], sizeof(int));
+	}
+	snap_write(fp, pools, npools * sizeof(struct pool));
+	snap_write(fp, coremap, memsize * sizeof(struct frame));
+	snap_write(fp, physmem, memsize * SIMPAGESIZE);
+	pagetable_save(fp);
+	swap_save(fp);
+	cost_save(fp);
+	if (save_fcn != NULL) {
+		save_fcn(fp);
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+		perror("Error writing snapshot");
+		exit(1);
+	}
+	free(tmp);
+}
+
+/*
+ * Reads the header of the snapshot at path and restores the configuration
+ * it was taken with. This must happen before the simulation is set up.
+ */
+void snapshot_load_config(char *path) {
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror("Error opening snapshot");
+		exit(1);
+	}
+	snap_read(fp, &header, sizeof(header));
+	fclose(fp);
+
+	if (memcmp(header.magic, SNAP_MAGIC, sizeof(header.magic)) != 0) {
+		fprintf(stderr, "Error: %s is not a snapshot\n", path);
+		exit(1);
+	}
+	simpagesize = header.simpagesize;
+	page_shift = header.page_shift;
+	addr_bits = header.addr_bits;
+	memsize = header.memsize;
+	swapsize = header.swapsize;
+	npools = header.npools;
+	thp_threshold = header.thp_threshold;
+	thp_demote = header.thp_demote;
+	numa_policy = header.numa_policy;
+	numa_cpu_node = header.numa_cpu_node;
+	numa_preferred_node = header.numa_preferred_node;
+}
+
+/*
+ * Restores the state saved in the snapshot at path into the (freshly
+ * initialized) simulation and returns the index in the trace to resume
+ * from.
+ * The algorithm's own state is only restored if it is the algorithm the
+ * snapshot was taken with; returns in *same_alg whether that was the case.
+ */
+size_t snapshot_restore(char *path, int *same_alg) {
+	unsigned i;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror("Error opening snapshot");
+		exit(1);
+	}
+	snap_read(fp, &header, sizeof(header));
+	for (i = 0; i < NCOUNTERS; i++) {
+		snap_read(fp, counters[i], sizeof(int));
+	}
+	snap_read(fp, pools, npools * sizeof(struct pool));
+	snap_read(fp, coremap, memsize * sizeof(struct frame));
+	snap_read(fp, physmem, memsize * SIMPAGESIZE);
+	pagetable_load(fp);	// also points coremap entries at their ptes
+	swap_load(fp);
+	cost_load(fp);
+
+	*same_alg = (strcmp(header.alg, alg_name) == 0);
+	if (*same_alg && load_fcn != NULL) {
+		load_fcn(fp);
+	}
+	fclose(fp);
+	return header.trace_index;
+}
@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/uio.h>
 #include "pagetable.h"
 #include "sim.h"
 
@@ -86,6 +87,37 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         return 1;
 }
 
+/*
+ * Allocates n consecutive bits, the first at *index. Returns 1 if there is
+ * no such run free.
+ */
+int
+bitmap_alloc_range(struct bitmap *b, unsigned n, unsigned *index)
+{
+        unsigned ix, run = 0;
+
+        for (ix = 0; ix < b->nbits; ix++) {
+                if (b->v[ix / BITS_PER_WORD] == WORD_ALLBITS) {
+                        run = 0;
+                        ix += BITS_PER_WORD - 1 - ix % BITS_PER_WORD;
+                        continue;
+                }
+                if (b->v[ix / BITS_PER_WORD] & ((unsigned)1 << (ix % BITS_PER_WORD))) {
+                        run = 0;
+                        continue;
+                }
+                if (++run == n) {
+                        *index = ix + 1 - n;
+                        for (ix = *index; ix < *index + n; ix++) {
+                                b->v[ix / BITS_PER_WORD] |=
+                                        (unsigned)1 << (ix % BITS_PER_WORD);
+                        }
+                        return 0;
+                }
+        }
+        return 1;
+}
+
 static
 inline
 void
@@ -148,6 +180,10 @@ static int swapfd;
 static struct bitmap *swapmap;
 static char *fname;
 
+int swap_write_ops = 0;
+int swap_pages_written = 0;
+int swap_read_ops = 0;
+
 int swap_init(unsigned swapsize) {
 
 	// Initialize the swap file
@@ -178,6 +214,51 @@ void swap_destroy() {
 	return;
 }
 
+// Write the swap bitmap and the data of every allocated slot to a snapshot.
+void swap_save(FILE *fp) {
+	unsigned i;
+	unsigned words = DIVROUNDUP(swapmap->nbits, BITS_PER_WORD);
+	char page[SIMPAGESIZE];
+
+	snap_write(fp, &swapmap->nbits, sizeof(unsigned));
+	snap_write(fp, swapmap->v, words * sizeof(unsigned));
+	for (i = 0; i < swapmap->nbits; i++) {
+		if (bitmap_isset(swapmap, i)) {
+			if (pread(swapfd, page, SIMPAGESIZE, (off_t)i * SIMPAGESIZE)
+			    != SIMPAGESIZE) {
+				perror("swap_save: failed to read swap slot");
+				exit(1);
+			}
+			snap_write(fp, page, SIMPAGESIZE);
+		}
+	}
+}
+
+// Restore the swap bitmap and slot data written by swap_save into the
+// (empty) swap file created by swap_init.
+void swap_load(FILE *fp) {
+	unsigned i, nbits;
+	unsigned words = DIVROUNDUP(swapmap->nbits, BITS_PER_WORD);
+	char page[SIMPAGESIZE];
+
+	snap_read(fp, &nbits, sizeof(unsigned));
+	if (nbits != swapmap->nbits) {
+		fprintf(stderr, "Error: snapshot swap size does not match\n");
+		exit(1);
+	}
+	snap_read(fp, swapmap->v, words * sizeof(unsigned));
+	for (i = 0; i < swapmap->nbits; i++) {
+		if (bitmap_isset(swapmap, i)) {
+			snap_read(fp, page, SIMPAGESIZE);
+			if (pwrite(swapfd, page, SIMPAGESIZE, (off_t)i * SIMPAGESIZE)
+			    != SIMPAGESIZE) {
+				perror("swap_load: failed to write swap slot");
+				exit(1);
+			}
+		}
+	}
+}
+
 // Read data into (simulated) physical memory 'frame' from 'swap_offset'
 // in swap file.
 // Input:  frame - the physical frame number (not byte offset) in physmem
@@ -187,7 +268,6 @@ void swap_destroy() {
 // 
 int swap_pagein(unsigned frame, int swap_offset) {
 	char *frame_ptr;
-	off_t pos;
 	ssize_t bytes_read;
 	
 	assert(swap_offset != INVALID_SWAP);
@@ -195,16 +275,16 @@ int swap_pagein(unsigned frame, int swap_offset) {
 	// Get pointer to page data in (simulated) physical memory
 	frame_ptr = &physmem[frame * SIMPAGESIZE];
 
-	// Seek to position in swap file where this page was stored
-	pos = lseek(swapfd, swap_offset, SEEK_SET);
-	if (pos != swap_offset) {
-		assert(pos == (off_t)-1);
-		perror("swap_pagein: failed to set read position");
+	// Read page data from swapfile into memory. pread does not move the
+	// file position, so threads can page in and out concurrently.
+	PROF_BEGIN(PROF_SWAP);
+	bytes_read = pread(swapfd, frame_ptr, SIMPAGESIZE, swap_offset);
+	PROF_END(PROF_SWAP);
+	__atomic_fetch_add(&swap_read_ops, 1, __ATOMIC_RELAXED);
+	if (bytes_read == -1) {
+		perror("swap_pagein: failed to read page");
 		return -errno;
 	}
-
-	// Read page data from swapfile into memory
-	bytes_read = read(swapfd, frame_ptr, SIMPAGESIZE);
 	if (bytes_read != SIMPAGESIZE) {
 		fprintf(stderr,"swap_pagein: did not read whole page\n");
 		return bytes_read;
@@ -221,7 +301,6 @@ int swap_pagein(unsigned frame, int swap_offset) {
 // 
 int swap_pageout(unsigned frame, int swap_offset) {
 	char *frame_ptr;
-	off_t pos;
 	unsigned idx;
 	ssize_t bytes_written;
 
@@ -238,19 +317,67 @@ int swap_pageout(unsigned frame, int swap_offset) {
 	// Get pointer to page data in (simulated) physical memory
 	frame_ptr = &physmem[frame * SIMPAGESIZE];
 
-	// Seek to position in swap file where this page will be stored
-	pos = lseek(swapfd, swap_offset, SEEK_SET);
-	if (pos != swap_offset) {
-		assert(pos == (off_t)-1);
-		perror("swap_pageout: failed to set write position");
-		return INVALID_SWAP;
-	}
-
-	// Read page data from swapfile into memory
-	bytes_written = write(swapfd, frame_ptr, SIMPAGESIZE);
+	// Write page data from memory to swapfile
+	PROF_BEGIN(PROF_SWAP);
+	bytes_written = pwrite(swapfd, frame_ptr, SIMPAGESIZE, swap_offset);
+	PROF_END(PROF_SWAP);
 	if (bytes_written != SIMPAGESIZE) {
 		fprintf(stderr,"swap_pageout: did not write whole page\n");
 		return INVALID_SWAP;
 	}
+	__atomic_fetch_add(&swap_write_ops, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&swap_pages_written, 1, __ATOMIC_RELAXED);
 	return swap_offset;
 }
+
+// Write data from the n (simulated) physical memory 'frames' to swap as a
+// cluster: their old slots are released and the pages written to n
+// contiguous slots with a single write. If there is no such run of free
+// slots, each page is written on its own.
+// Input:  frames - the physical frame numbers
+//         offsets - the pages' current swap offsets (or INVALID_SWAP),
+//                   replaced by the offsets written to
+// Return: 0 on success, or INVALID_SWAP on failure
+//
+int swap_pageout_cluster(unsigned *frames, int *offsets, int n) {
+	struct iovec iov[MAX_RECLAIM_BATCH];
+	unsigned idx;
+	ssize_t bytes;
+	int i;
+
+	assert(n <= MAX_RECLAIM_BATCH);
+	if (n == 0) {
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		if (offsets[i] != INVALID_SWAP) {
+			bitmap_unmark(swapmap, offsets[i] / SIMPAGESIZE);
+			offsets[i] = INVALID_SWAP;
+		}
+	}
+
+	if (n == 1 || bitmap_alloc_range(swapmap, n, &idx) != 0) {
+		for (i = 0; i < n; i++) {
+			if ((offsets[i] = swap_pageout(frames[i], INVALID_SWAP)) == INVALID_SWAP) {
+				return INVALID_SWAP;
+			}
+		}
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = &physmem[frames[i] * SIMPAGESIZE];
+		iov[i].iov_len = SIMPAGESIZE;
+		offsets[i] = (idx + i) * SIMPAGESIZE;
+	}
+	PROF_BEGIN(PROF_SWAP);
+	bytes = pwritev(swapfd, iov, n, (off_t)idx * SIMPAGESIZE);
+	PROF_END(PROF_SWAP);
+	if (bytes != n * SIMPAGESIZE) {
+		fprintf(stderr,"swap_pageout_cluster: did not write whole cluster\n");
+		return INVALID_SWAP;
+	}
+	swap_write_ops++;
+	swap_pages_written += n;
+	return 0;
+}
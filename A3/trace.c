@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sim.h"
+#include "pagetable.h"
+
+//---------------------------------------------------------------------
+// Trace loading. The text trace is mapped into memory, split into chunks
+// on line boundaries and parsed by one thread per chunk into a single
+// array of packed references (see ref_t in sim.h). Each thread first
+// counts the references in its chunk, so that it knows where in the array
+// its own references go, then parses them.
+//
+// Lines starting with '=' (valgrind's messages) and blank lines are
+// skipped. Every other line is "<type> <hex address>", optionally indented
+// and with a "0x" prefix; anything after the address is ignored.
+
+#define MIN_CHUNK (1 << 20)	// don't split traces into chunks below 1 MiB
+
+struct trace trace = {NULL, 0};
+int loader_threads = 0;		// 0 for one thread per online cpu
+int run_length = 0;
+int trace_stream = 0;
+
+// Streamed trace (-z): the current reference and the ones after it, up to
+// the lookahead asked for, in a ring buffer.
+static FILE *stream_fp;
+static ref_t *ring;
+static size_t ring_size, ring_head, ring_count;
+
+struct chunk {
+	const char *start;
+	const char *end;
+	ref_t *refs;		// where this chunk's references go
+	size_t nrefs;
+	ref_t all;		// all of its references or'ed together
+};
+
+// Value of each hex digit, -1 for any other character.
+static signed char hexval[256];
+
+static void init_hexval() {
+	int c;
+	memset(hexval, -1, sizeof(hexval));
+	for (c = '0'; c <= '9'; c++) {
+		hexval[c] = c - '0';
+	}
+	for (c = 'a'; c <= 'f'; c++) {
+		hexval[c] = c - 'a' + 10;
+		hexval[c - 'a' + 'A'] = c - 'a' + 10;
+	}
+}
+
+/* Returns true if the line starting at p holds a reference. */
+static inline int is_ref_line(const char *p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	return p < end && *p != '=' && *p != '\n' && *p != '\r';
+}
+
+/* Exits if the trace has addresses wider than addr_bits (see -x), which
+ * the page directory can't index.
+ */
+static void check_width(ref_t all) {
+	if (REF_ADDR(all) >> addr_bits) {
+		fprintf(stderr, "Error: trace has addresses wider than %u bits\n",
+			addr_bits);
+		exit(1);
+	}
+}
+
+static inline ref_t parse_ref(const char *p, const char *end) {
+	addr_t vaddr = 0;
+	char type;
+	int v;
+
+	while (*p == ' ' || *p == '\t') {
+		p++;
+	}
+	type = *p++;
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	if (p + 1 < end && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+		p += 2;
+	}
+	while (p < end && (v = hexval[(unsigned char)*p]) >= 0) {
+		vaddr = (vaddr << 4) | v;
+		p++;
+	}
+	return MAKE_REF(type, vaddr);
+}
+
+static void *count_chunk(void *arg) {
+	struct chunk *c = arg;
+	const char *p = c->start, *nl;
+
+	c->nrefs = 0;
+	while (p < c->end) {
+		nl = memchr(p, '\n', c->end - p);
+		if (nl == NULL) {
+			nl = c->end;
+		}
+		if (is_ref_line(p, nl)) {
+			c->nrefs++;
+		}
+		p = nl + 1;
+	}
+	return NULL;
+}
+
+static void *parse_chunk(void *arg) {
+	struct chunk *c = arg;
+	const char *p = c->start, *nl;
+	ref_t *r = c->refs;
+
+	c->all = 0;
+	while (p < c->end) {
+		nl = memchr(p, '\n', c->end - p);
+		if (nl == NULL) {
+			nl = c->end;
+		}
+		if (is_ref_line(p, nl)) {
+			*r = parse_ref(p, nl);
+			c->all |= *r++;
+		}
+		p = nl + 1;
+	}
+	return NULL;
+}
+
+/* Runs fn on every chunk, each in its own thread. */
+static void run_chunks(void *(*fn)(void *), struct chunk *chunks, int n) {
+	pthread_t tids[n];
+	int i;
+
+	for (i = 1; i < n; i++) {
+		if (pthread_create(&tids[i], NULL, fn, &chunks[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	fn(&chunks[0]);
+	for (i = 1; i < n; i++) {
+		pthread_join(tids[i], NULL);
+	}
+}
+
+/* Parses the size bytes of trace text at buf into t. */
+static void parse_trace(struct trace *t, const char *buf, size_t size) {
+	int i, n = loader_threads;
+	size_t first = 0;
+	const char *end = buf + size;
+
+	if (n <= 0) {
+		n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (n > size / MIN_CHUNK) {
+		n = size / MIN_CHUNK;
+	}
+	if (n < 1) {
+		n = 1;
+	}
+
+	// Split at the first line boundary after each multiple of size/n.
+	struct chunk chunks[n];
+	chunks[0].start = buf;
+	for (i = 1; i < n; i++) {
+		const char *p = buf + size / n * i;
+		const char *nl = memchr(p, '\n', end - p);
+		chunks[i].start = nl ? nl + 1 : end;
+		if (chunks[i].start < chunks[i-1].start) {
+			chunks[i].start = chunks[i-1].start;
+		}
+		chunks[i-1].end = chunks[i].start;
+	}
+	chunks[n-1].end = end;
+
+	run_chunks(count_chunk, chunks, n);
+	for (i = 0; i < n; i++) {
+		first += chunks[i].nrefs;
+	}
+	t->nrefs = first;
+	t->refs = malloc((t->nrefs ? t->nrefs : 1) * sizeof(ref_t));
+	if (t->refs == NULL) {
+		perror("Failed to allocate trace");
+		exit(1);
+	}
+	first = 0;
+	for (i = 0; i < n; i++) {
+		chunks[i].refs = t->refs + first;
+		first += chunks[i].nrefs;
+	}
+	run_chunks(parse_chunk, chunks, n);
+	for (i = 0; i < n; i++) {
+		check_width(chunks[i].all);
+	}
+}
+
+/*
+ * Loads the trace in the file path (standard input if path is NULL) into
+ * t.
+ */
+void trace_load(struct trace *t, char *path) {
+	int fd;
+	struct stat st;
+	char *buf;
+
+	init_hexval();
+
+	if (path == NULL) {
+		// A pipe can't be mapped; read it all into memory instead.
+		size_t size = 0, cap = MIN_CHUNK;
+		ssize_t n;
+		buf = malloc(cap);
+		while (buf != NULL && (n = read(0, buf + size, cap - size)) > 0) {
+			size += n;
+			if (size == cap) {
+				cap *= 2;
+				buf = realloc(buf, cap);
+			}
+		}
+		if (buf == NULL) {
+			perror("Failed to read trace");
+			exit(1);
+		}
+		parse_trace(t, buf, size);
+		free(buf);
+		return;
+	}
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		perror("Error opening tracefile:");
+		exit(1);
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		parse_trace(t, "", 0);
+		return;
+	}
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED) {
+		perror("Failed to map tracefile");
+		exit(1);
+	}
+	madvise(buf, st.st_size, MADV_SEQUENTIAL);
+	parse_trace(t, buf, st.st_size);
+	munmap(buf, st.st_size);
+	close(fd);
+}
+
+/*
+ * Collapses the references of t, from reference first on, into runs of
+ * consecutive references to the same page. When statistics by access type
+ * are printed (-t or split mode), a run also ends where the access type
+ * changes.
+ */
+void trace_runs(struct trace *t, size_t first, struct runs *r) {
+	size_t i;
+	struct run *run = NULL;
+
+	r->nruns = 0;
+	r->runs = malloc((t->nrefs > first ? t->nrefs - first : 1) *
+			 sizeof(struct run));
+	if (r->runs == NULL) {
+		perror("Failed to allocate runs");
+		exit(1);
+	}
+	for (i = first; i < t->nrefs; i++) {
+		addr_t vaddr = REF_ADDR(t->refs[i]);
+		char type = REF_TYPE(t->refs[i]);
+		int write = (type == 'S' || type == 'M');
+
+		if (run != NULL && (run->vaddr >> PAGE_SHIFT) == (vaddr >> PAGE_SHIFT) &&
+		    run->count < UINT_MAX && ((!type_stats && split_iframes == 0) || run->type == type)) {
+			run->count++;
+			run->write |= write;
+			continue;
+		}
+		run = &r->runs[r->nruns++];
+		run->vaddr = vaddr;
+		run->count = 1;
+		run->type = type;
+		run->write = write;
+	}
+	if (r->nruns > 0) {
+		r->runs = realloc(r->runs, r->nruns * sizeof(struct run));
+	}
+}
+
+/*
+ * Opens the trace in the file path (standard input if path is NULL) for
+ * streaming, keeping up to lookahead references after the current one.
+ */
+void trace_open(char *path, size_t lookahead) {
+	init_hexval();
+	stream_fp = stdin;
+	if (path != NULL && (stream_fp = fopen(path, "r")) == NULL) {
+		perror("Error opening tracefile:");
+		exit(1);
+	}
+	ring_size = lookahead + 1;
+	ring = malloc(ring_size * sizeof(ref_t));
+	if (ring == NULL) {
+		perror("Failed to allocate lookahead");
+		exit(1);
+	}
+	ring_head = ring_count = 0;
+}
+
+static int stream_read(ref_t *ref) {
+	char buf[MAXLINE];
+
+	while (fgets(buf, MAXLINE, stream_fp) != NULL) {
+		const char *end = buf + strlen(buf);
+		if (is_ref_line(buf, end)) {
+			*ref = parse_ref(buf, end);
+			check_width(*ref);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Moves on to the next reference of the streamed trace and stores it in
+ * *ref. Returns 0 at the end of the trace.
+ */
+int trace_next(ref_t *ref) {
+	if (ring_count > 0) {
+		ring_head = (ring_head + 1) % ring_size;
+		ring_count--;
+	}
+	while (ring_count < ring_size &&
+	       stream_read(&ring[(ring_head + ring_count) % ring_size])) {
+		ring_count++;
+	}
+	if (ring_count == 0) {
+		return 0;
+	}
+	*ref = ring[ring_head];
+	return 1;
+}
+
+void trace_close() {
+	if (stream_fp != stdin) {
+		fclose(stream_fp);
+	}
+	free(ring);
+	stream_fp = NULL;
+}
+
+/*
+ * Stores in *ref the reference i places after the one being simulated (0
+ * for that one), from the loaded or the streamed trace. Returns 0 if the
+ * trace ends before, or if a streamed trace is not read that far ahead.
+ */
+int trace_ahead(size_t i, ref_t *ref) {
+	if (stream_fp != NULL) {
+		if (i >= ring_count) {
+			return 0;
+		}
+		*ref = ring[(ring_head + i) % ring_size];
+		return 1;
+	}
+	if (ref_count + i >= trace.nrefs) {
+		return 0;
+	}
+	*ref = trace.refs[ref_count + i];
+	return 1;
+}